@@ -19,6 +19,7 @@
 
 #include "LjSOM.h"
 #include "SomLjObjectManager.h"
+#include "SomLjbcCompiler2.h"
 #include <LjTools/Engine2.h>
 #include <LjTools/LuaJitComposer.h>
 #include <LuaJIT/src/lua.hpp>
@@ -27,6 +28,7 @@
 #include <lua.hpp>
 #include <iostream>
 #include <QFile>
+#include <QFileInfo>
 using namespace Som;
 using namespace Lua;
 
@@ -72,6 +74,23 @@ static int hashOf(lua_State * L)
     case LUA_TLIGHTUSERDATA:
         h = (lua_Integer)lua_topointer( L, 1 );
         break;
+    default:
+        if( qstrcmp( lua_typename( L, lua_type(L,1) ), "cdata" ) == 0 )
+        {
+            // Doubles are the only cdata values of SOM; equal values must have equal hashes, also the Integers
+            lua_getfield( L, 1, "_dbl" );
+            const double d = lua_tonumber(L,-1);
+            lua_pop(L,1);
+            if( d >= -2147483648.0 && d <= 2147483647.0 && d == double(int(d)) )
+                h = int(d);
+            else
+            {
+                quint64 bits;
+                ::memcpy( &bits, &d, sizeof(d) );
+                h = int( bits ^ ( bits >> 32 ) );
+            }
+        }
+        break;
     }
 
     lua_pushinteger( L, h );
@@ -132,6 +151,11 @@ bool LjSOM::load(const QString& file, const QString& paths)
     return d_om->load(file,classPaths);
 }
 
+bool LjSOM::loadBundle(const QString& file)
+{
+    return d_om->loadBundle(file);
+}
+
 #if 0
 static int dump_trace(lua_State* L)
 {
@@ -257,23 +281,44 @@ int main(int argc, char *argv[])
 
     QString somFile;
     QString somPaths;
+    QString cacheDir;
+    QString bundle;
+    bool snapshot = false;
+    QByteArray warmUp;
     bool lua = false;
     bool clo = false;
     bool useJit = true;
     bool trace = false;
+    bool gen = false;
+    quint32 options = LjbcCompiler2::DefaultOptions;
     QStringList extraArgs;
     const QStringList args = QCoreApplication::arguments();
     for( int i = 1; i < args.size(); i++ ) // arg 0 enthaelt Anwendungspfad
     {
         if( args[i] == "-h" || args.size() == 1 )
         {
-            out << "usage: [options] som_file [extra_args]" << endl;
+            out << "usage: [options] som_file|bundle_file.ljb [extra_args]" << endl;
             out << "options:" << endl;
             out << "  -cp       paths to som files, separated by ':'" << endl;
             out << "            Note that path of som_file is automatically added and" << endl;
             out << "            the Smalltalk files are integrated in the executable" << endl;
             out << "  -lua      generate Lua source code instead of bytecode" << endl;
             out << "  -clo      generate bytecode with blocks as closures (using FNEW/UCLO)" << endl;
+            out << "  -gen      also write the generated code to the Lua subdirectory" << endl;
+            out << "  -cache    directory where the compiled program is kept for later runs" << endl;
+            out << "  -bundle   write the compiled program to the given .ljb file instead of running it;" << endl;
+            out << "            the bundle has to be run with the same code generation options" << endl;
+            out << "  -snapshot like -bundle, but also write the class fields and globals" << endl;
+            out << "  -warmup   run the given unary method of the main class before the snapshot;" << endl;
+            out << "            requires -snapshot" << endl;
+            out << "  -noint    don't inline Integer arithmetic and comparisons" << endl;
+            out << "  -nocha    don't call methods of monomorphic sends directly" << endl;
+            out << "  -noinl    don't inline small methods" << endl;
+            out << "  -nonlr    check for non-local returns after each send" << endl;
+            out << "  -notail   don't use tail calls for sends in return position" << endl;
+            out << "  -noesc    instantiate all block literals passed to non-escaping params" << endl;
+            out << "  -cust     compile inherited methods for subclasses with more known self sends" << endl;
+            out << "  -nopeep   don't run the peephole optimizer over the generated bytecode" << endl;
             out << "  -nojit    switch off JIT" << endl;
             out << "  -trace    output tracer results" << endl;
             out << "  -h        display this information" << endl;
@@ -284,8 +329,26 @@ int main(int argc, char *argv[])
                     useJit = false;
         else if( args[i] == "-clo" )
                     clo = false;
+        else if( args[i] == "-gen" )
+                    gen = true;
         else if( args[i] == "-trace" )
                     trace = true;
+        else if( args[i] == "-noint" )
+                    options &= ~LjbcCompiler2::IntegerFastPath;
+        else if( args[i] == "-nocha" )
+                    options &= ~LjbcCompiler2::Devirtualize;
+        else if( args[i] == "-noinl" )
+                    options &= ~LjbcCompiler2::InlineMethods;
+        else if( args[i] == "-nonlr" )
+                    options &= ~LjbcCompiler2::NlrAnalysis;
+        else if( args[i] == "-notail" )
+                    options &= ~LjbcCompiler2::TailCalls;
+        else if( args[i] == "-noesc" )
+                    options &= ~LjbcCompiler2::ReuseBlocks;
+        else if( args[i] == "-cust" )
+                    options |= LjbcCompiler2::Customize;
+        else if( args[i] == "-nopeep" )
+                    options &= ~LjbcCompiler2::Peephole;
         else if( args[i] == "-cp" )
         {
             if( i+1 >= args.size() )
@@ -297,6 +360,40 @@ int main(int argc, char *argv[])
                 somPaths = args[i+1];
                 i++;
             }
+        }else if( args[i] == "-cache" )
+        {
+            if( i+1 >= args.size() )
+            {
+                qCritical() << "error: invalid -cache option";
+                return -1;
+            }else
+            {
+                cacheDir = args[i+1];
+                i++;
+            }
+        }else if( args[i] == "-bundle" || args[i] == "-snapshot" )
+        {
+            if( i+1 >= args.size() )
+            {
+                qCritical() << "error: invalid" << args[i] << "option";
+                return -1;
+            }else
+            {
+                bundle = args[i+1];
+                snapshot = args[i] == "-snapshot";
+                i++;
+            }
+        }else if( args[i] == "-warmup" )
+        {
+            if( i+1 >= args.size() )
+            {
+                qCritical() << "error: invalid -warmup option";
+                return -1;
+            }else
+            {
+                warmUp = args[i+1].toUtf8();
+                i++;
+            }
         }else if( !args[ i ].startsWith( '-' ) )
         {
             if( somFile.isEmpty() )
@@ -317,11 +414,34 @@ int main(int argc, char *argv[])
         qCritical() << "error: expecting a SOM file with a run method; use -h for help.";
         return -1;
     }
+    if( !warmUp.isEmpty() && !snapshot )
+    {
+        qCritical() << "error: -warmup requires -snapshot";
+        return -1;
+    }
     vm.setGenLua(lua);
     vm.setGenClosures(clo);
-    if( !vm.load(somFile, somPaths) )
+    vm.getOm()->setOptions(options);
+    vm.getOm()->setWriteFiles(gen);
+    vm.getOm()->setCacheDir(cacheDir);
+    if( QFileInfo(somFile).suffix() == "ljb" )
+    {
+        if( !vm.loadBundle(somFile) )
+            return -1;
+    }else if( !vm.load(somFile, somPaths) )
         return -1;
 
+    if( !bundle.isEmpty() )
+    {
+        if( !warmUp.isEmpty() )
+            vm.getOm()->setArgs(extraArgs);
+        if( ( warmUp.isEmpty() || vm.getOm()->warmUp(warmUp) ) && vm.getOm()->saveBundle(bundle,snapshot) )
+            return 0;
+        foreach( const QString& str, vm.getOm()->getErrors() )
+            qCritical() << str.toUtf8().constData();
+        return -1;
+    }
+
     if( vm.run(useJit,trace,extraArgs) )
         return 0;
     else
@@ -39,7 +39,8 @@ SOURCES += \
     ../LjTools/Engine2.cpp \
     ../LjTools/LuaJitComposer.cpp \
     LjSOM.cpp \
-    SomLjbcCompiler2.cpp
+    SomLjbcCompiler2.cpp \
+    SomLjbcPeephole.cpp
 
 
 HEADERS  += \ 
@@ -53,7 +54,8 @@ HEADERS  += \
     ../LjTools/Engine2.h \
     ../LjTools/LuaJitComposer.h \
     LjSOM.h \
-    SomLjbcCompiler2.h
+    SomLjbcCompiler2.h \
+    SomLjbcPeephole.h
 
 
 win32 {
@@ -167,7 +167,9 @@ namespace Ast
     };
 
     enum PatternType { NoPattern, UnaryPattern, BinaryPattern, KeywordPattern };
-    enum FlowControl { NoFlowControl, IfTrue, IfFalse, IfElse, WhileTrue, WhileFalse };
+    enum FlowControl { NoFlowControl, IfTrue, IfFalse, IfElse, WhileTrue, WhileFalse,
+                       And, Or, Not, IsNil, NotNil, IfNil, IfNotNil, IfNilIfNotNil,
+                       ToDo, ToByDo, DownToDo, DownToByDo, TimesRepeat }; // loops from ToDo only in LjbcCompiler2
 
     struct MsgSend : public Expression
     {
@@ -257,13 +259,14 @@ namespace Ast
         quint8 d_primitive : 1; // specified primitive id or zero
         quint8 d_hasNonLocalReturn : 1;
         quint8 d_hasNonLocalReturnIfInlined : 1;
+        quint32 d_nlrToken; // identifies this method as the target of non-local returns; assigned by LjObjectManager
         QByteArrayList d_pattern; // compact form in d_name
         QByteArray d_category;
         ExpList d_helper;
         Ref<Variable> d_self;
 
         Method():d_patternType(NoPattern),d_classLevel(false),d_primitive(false),
-            d_hasNonLocalReturn(false),d_hasNonLocalReturnIfInlined(false){}
+            d_hasNonLocalReturn(false),d_hasNonLocalReturnIfInlined(false),d_nlrToken(0){}
         static QByteArray prettyName(const QByteArrayList& pattern, quint8 kind, bool withSpace = true );
         QByteArray prettyName(bool withSpace = true) const;
         int getTag() const { return T_Method; }
@@ -277,9 +280,10 @@ namespace Ast
     {
         enum { InstanceLevel, ClassLevel, Argument, Temporary, Global };
         quint8 d_kind;
+        quint8 d_captured : 1; // accessed by a non-inlined block other than d_inlinedOwner
         quint16 d_slot; // to be set by compiler
         Function* d_inlinedOwner;
-        Variable():d_kind(InstanceLevel),d_slot(0),d_inlinedOwner(0){}
+        Variable():d_kind(InstanceLevel),d_captured(0),d_slot(0),d_inlinedOwner(0){}
         int getTag() const { return T_Variable; }
         void accept(Visitor* v) { v->visit(this); }
         bool classLevel() const { return d_kind == ClassLevel; }
@@ -21,6 +21,7 @@
 #include <QBuffer>
 #include <QIODevice>
 #include <QtDebug>
+#include <QReadWriteLock>
 using namespace Som;
 
 // Adapted from Smalltalk StLexer.cpp/h
@@ -35,6 +36,7 @@ const char* Lexer::s_typeName[] = {
 };
 
 QHash<QByteArray,QByteArray> Lexer::d_symbols;
+static QReadWriteLock s_symbolsLock; // files are lexed in parallel
 
 Lexer::Lexer() : d_in(0), d_eatComments(true), d_fragMode(false)
 {
@@ -516,7 +518,14 @@ QByteArray Lexer::getSymbol(const QByteArray& str)
 {
     if( str.isEmpty() )
         return str;
-    QByteArray& sym = d_symbols[str];
+    {
+        QReadLocker lock(&s_symbolsLock);
+        QHash<QByteArray,QByteArray>::const_iterator i = d_symbols.constFind(str);
+        if( i != d_symbols.constEnd() )
+            return i.value();
+    }
+    QWriteLocker lock(&s_symbolsLock);
+    QByteArray& sym = d_symbols[str]; // another thread could have added it in the meantime
     if( sym.isEmpty() )
         sym = str;
     return sym;
@@ -23,8 +23,16 @@
 #include "SomLuaTranspiler.h"
 #include "SomLjbcCompiler.h"
 #include "SomLjbcCompiler2.h"
+#include "SomLjbcPeephole.h"
 #include <QDir>
 #include <QFileInfo>
+#include <QBuffer>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QVector>
 #include <QtDebug>
 #include <LjTools/Engine2.h>
 #include <QDateTime>
@@ -59,7 +67,7 @@ using namespace Som::Ast;
     true, false and nil are represented by Lua values with metatable pointing to the appropriate SOM class
     SOM Integer is represented by Lua number with metaclass pointing to Integer class
 
-    Internal names: _primitives, _name, _super, _class, _meta, _fields
+    Internal names: _primitives, _name, _super, _class, _meta, _fields, _new (cached constructor)
   */
 
 struct LjObjectManager::ResolveIdents : public Visitor
@@ -81,9 +89,19 @@ struct LjObjectManager::ResolveIdents : public Visitor
         d_toInline.insert( Lexer::getSymbol("ifTrue:ifFalse:").constData(), qMakePair(IfElse,2)); // ST80
         d_toInline.insert( Lexer::getSymbol("whileFalse:").constData(), qMakePair(WhileFalse,1)); // ST80
         d_toInline.insert( Lexer::getSymbol("whileTrue:").constData(), qMakePair(WhileTrue,1)); // ST80
-#if 0
-        d_toInline.insert( Lexer::getSymbol("timesRepeat:"));
-#endif
+        d_toInline.insert( Lexer::getSymbol("and:").constData(), qMakePair(And,1)); // ST80
+        d_toInline.insert( Lexer::getSymbol("or:").constData(), qMakePair(Or,1)); // ST80
+        d_toInline.insert( Lexer::getSymbol("not").constData(), qMakePair(Not,0));
+        d_toInline.insert( Lexer::getSymbol("isNil").constData(), qMakePair(IsNil,0));
+        d_toInline.insert( Lexer::getSymbol("notNil").constData(), qMakePair(NotNil,0));
+        d_toInline.insert( Lexer::getSymbol("ifNil:").constData(), qMakePair(IfNil,1));
+        d_toInline.insert( Lexer::getSymbol("ifNotNil:").constData(), qMakePair(IfNotNil,1));
+        d_toInline.insert( Lexer::getSymbol("ifNil:ifNotNil:").constData(), qMakePair(IfNilIfNotNil,2));
+        d_toInline.insert( Lexer::getSymbol("to:do:").constData(), qMakePair(ToDo,2)); // ST80
+        d_toInline.insert( Lexer::getSymbol("to:by:do:").constData(), qMakePair(ToByDo,3)); // ST80
+        d_toInline.insert( Lexer::getSymbol("downTo:do:").constData(), qMakePair(DownToDo,2));
+        d_toInline.insert( Lexer::getSymbol("downTo:by:do:").constData(), qMakePair(DownToByDo,3));
+        d_toInline.insert( Lexer::getSymbol("timesRepeat:").constData(), qMakePair(TimesRepeat,1)); // ST80
 
         // ST80: MessageNode comment
         // If special>0, I compile special code in-line instead of sending
@@ -209,48 +227,23 @@ struct LjObjectManager::ResolveIdents : public Visitor
         for( int i = 0; i < b->d_func->d_body.size(); i++ )
             b->d_func->d_body[i]->accept(this);
 
-#if 0
-        // determine where this block needs to be declared and instantiated: on location
-        // (which is likely the most inefficient way) or on method level (if it requires no or upvalues
-        // originated on method level) or somewhere in between. Blocks not depending on method local vars can
-        // even be instantiated on module level.
-        // checked with Benchmarks, of the 69 non-inlined only 14 can be relocated, only one of which affects an inner
-        // loop; all others must remain in the methods where they are; so we cannot further get around the NYI list!!!
-        if( b->d_func->d_lowestUpvalueSource == 0 )
-        {
-            int level = 0;
-            for( int i = 0; i < b->d_func->d_blocks.size(); i++ )
-            {
-                if( b->d_func->d_blocks[i]->d_func->d_lowestUpvalueSource != 0 &&
-                        b->d_func->d_blocks[i]->d_func->d_lowestUpvalueSource->d_syntaxLevel > level )
-                {
-                    level = b->d_func->d_blocks[i]->d_func->d_lowestUpvalueSource->d_syntaxLevel;
-                    b->d_func->d_lowestUpvalueSource = b->d_func->d_blocks[i]->d_func->d_lowestUpvalueSource;
-                }
-            }
+        // determine where this block needs to be instantiated; a nested block depending on a function enclosing
+        // this block makes this block depend on it too because the environment is passed on via the block instance.
+        // Blocks depending on no enclosing function at all are instantiated only once on module level.
+        for( int i = 0; i < b->d_func->d_blocks.size(); i++ )
+        {
+            Function* source = b->d_func->d_blocks[i]->d_func->d_lowestUpvalueSource;
+            if( source != 0 && source->d_syntaxLevel < b->d_func->d_syntaxLevel &&
+                    ( b->d_func->d_lowestUpvalueSource == 0 ||
+                      b->d_func->d_lowestUpvalueSource->d_syntaxLevel < source->d_syntaxLevel ) )
+                b->d_func->d_lowestUpvalueSource = source;
         }
-        if( !b->d_func->d_inline )
+        if( !b->d_func->d_inline && b->d_func->d_lowestUpvalueSource == 0 )
         {
-            if( b->d_func->d_lowestUpvalueSource != 0 )
-            {
-                if( b->d_func->d_owner != b->d_func->d_lowestUpvalueSource )
-                {
-                    b->d_func->d_lowestUpvalueSource->d_relocated.append( b->d_func.data() );
-                    qDebug() << "moved" << printLoc(b->d_loc)
-                             << "to"<< (b->d_func->d_lowestUpvalueSource->getTag()==Thing::T_Method ? "method" : "" )
-                             << "level" << printLoc(b->d_func->d_lowestUpvalueSource->d_loc);
-                }else
-                    qDebug() << "left" << printLoc(b->d_loc) << "as is";
-            }else
-            {
-                Q_ASSERT( meth->d_owner->getTag() == Thing::T_Class );
-                // mdl->d_mainClass is not always set here!
-                static_cast<Class*>(meth->d_owner)->d_relocated.append( b->d_func.data() );
-                qDebug() << "moved" << printLoc(b->d_loc) << "to module level";
-            }
-        }else
-            qDebug() << "inlined" << printLoc(b->d_loc);
-#endif
+            Q_ASSERT( meth->d_owner->getTag() == Thing::T_Class );
+            // mdl->d_mainClass is not always set here!
+            static_cast<Class*>(meth->d_owner)->d_relocated.append( b->d_func.data() );
+        }
 
 
         blocks.pop_back();
@@ -302,14 +295,33 @@ struct LjObjectManager::ResolveIdents : public Visitor
                 if( blocks.back()->d_func->d_lowestUpvalueSource == 0 ||
                         blocks.back()->d_func->d_lowestUpvalueSource->d_syntaxLevel < owner->d_syntaxLevel )
                     blocks.back()->d_func->d_lowestUpvalueSource = owner;
-            }else if( blocks.back()->d_func->d_lowestUpvalueSource == 0 )
+
+                Q_ASSERT( n->getTag() == Thing::T_Variable );
+                Variable* v = static_cast<Variable*>(n);
+                if( v->d_inlinedOwner != currentFunction() )
+                    v->d_captured = true; // the variable is accessed from another (non-inlined) block function
+            }else
             {
-                // only class and instance level members arrive here because system has no owner
-                blocks.back()->d_func->d_lowestUpvalueSource = meth; // to access object members self is required
+                // only class and instance level members (and classes) arrive here because system has no owner
+                if( n->getTag() == Thing::T_Variable )
+                    markUpvalueSource( meth->d_self.data() ); // to access object members self is required
+                if( blocks.back()->d_func->d_lowestUpvalueSource == 0 )
+                    blocks.back()->d_func->d_lowestUpvalueSource = meth;
             }
         }
     }
 
+    Function* currentFunction() const
+    {
+        // the function which will actually be generated for the current position, i.e. inlined blocks don't count
+        if( blocks.isEmpty() )
+            return meth;
+        if( blocks.back()->d_func->d_inline )
+            return blocks.back()->d_func->inlinedOwner();
+        else
+            return blocks.back()->d_func.data();
+    }
+
     void visit( Ident* i )
     {
         Q_ASSERT( !stack.isEmpty() );
@@ -330,7 +342,8 @@ struct LjObjectManager::ResolveIdents : public Visitor
                 i->d_resolved = res.first();
                 Q_ASSERT( i->d_resolved->d_owner );
                 markUpvalueSource(i->d_resolved);
-            }
+            }else if( i->d_keyword == Expression::_super && !blocks.isEmpty() )
+                markUpvalueSource( meth->d_self.data() ); // super sends in Blocks pass self as receiver
             // Ident::MsgReceiver will be set elsewhere
             return;
         }
@@ -381,35 +394,78 @@ struct LjObjectManager::ResolveIdents : public Visitor
         }
         unresolved << i; // This must therefore be a not yet loaded class
     }
+    static inline bool isBlock( Expression* e, int paramCount )
+    {
+        return e->getTag() == Thing::T_Block &&
+                static_cast<Block*>( e )->d_func->getParamCount() == paramCount;
+    }
+
+    bool canInline( MsgSend* s, quint8 flowControl ) const
+    {
+        // the receiver ident is not yet resolved here
+        if( s->d_receiver->getTag() == Thing::T_Ident &&
+                mdl->d_keywords.value( static_cast<Ident*>(s->d_receiver.data())->d_ident.constData() ) ==
+                Expression::_super )
+            return false; // sends to super are never inlined
+
+        switch( flowControl )
+        {
+        case ToDo:
+        case ToByDo:
+        case DownToDo:
+        case DownToByDo:
+            // only the last argument is a block which is inlined into a numeric for loop; its parameter is the
+            // loop variable
+            if( mdl->d_genClosures )
+                return false;
+            return isBlock( s->d_args.last().data(), 1 );
+        case TimesRepeat:
+            if( mdl->d_genClosures )
+                return false;
+            return isBlock( s->d_args.last().data(), 0 );
+        default:
+            break;
+        }
+
+        // the inlined code evaluates the arguments (and the receiver of loops) in place, so they have to be
+        // literal blocks without parameters; otherwise e.g. a block in a variable would be the result instead
+        // of the result of the block
+        for( int i = 0; i < s->d_args.size(); i++ )
+        {
+            if( !isBlock( s->d_args[i].data(), 0 ) )
+                return false;
+        }
+        if( flowControl == WhileTrue || flowControl == WhileFalse )
+        {
+            if( !isBlock( s->d_receiver.data(), 0 ) )
+                return false;
+        }
+        return true;
+    }
+
     void visit( MsgSend* s)
     {
         // NOTE: we don't know here to whom the message is sent; otherwhise we could trace what
         // the receiver is doing with the block and inline everything if the block is not
         // really used as closure (i.e. only passed to be immediately called).
-        if( s->d_patternType == KeywordPattern )
+        if( s->d_patternType == KeywordPattern || s->d_patternType == UnaryPattern )
         {
             const QByteArray name = Lexer::getSymbol( s->prettyName(false) );
             ToInline::const_iterator it = d_toInline.find(name.constData());
-            if( it != d_toInline.end() && it.value().second == s->d_args.size() )
+            if( it != d_toInline.end() && it.value().second == s->d_args.size() && canInline(s, it.value().first) )
             {
-                bool hasBlocks = false;
-                for( int i = 0; i < s->d_args.size(); i++ )
+                // loops from ToDo only inline the last argument; limit and step are evaluated like normal args
+                for( int i = it.value().first < ToDo ? 0 : s->d_args.size() - 1; i < s->d_args.size(); i++ )
                 {
-                    if( s->d_args[i]->getTag() == Thing::T_Block )
-                    {
-                        hasBlocks = true;
-                        // qDebug() << "inlined" << printLoc(s->d_args[i]->d_loc);
-                        static_cast<Block*>( s->d_args[i].data() )->d_func->d_inline = true;
-                    }
+                    // qDebug() << "inlined" << printLoc(s->d_args[i]->d_loc);
+                    static_cast<Block*>( s->d_args[i].data() )->d_func->d_inline = true;
                 }
-                if( s->d_receiver->getTag() == Thing::T_Block )
+                if( s->d_receiver->getTag() == Thing::T_Block && it.value().first <= WhileFalse )
                 {
-                    hasBlocks = true;
                     // qDebug() << "inlined" << printLoc(s->d_receiver->d_loc);
                     static_cast<Block*>( s->d_receiver.data() )->d_func->d_inline = true;
                 }
-                if( hasBlocks )
-                    s->d_flowControl = it.value().first;
+                s->d_flowControl = it.value().first;
             }else if( s->d_receiver->getTag() == Thing::T_Number )
             {
                 // doesn't help much since all loops are eventually implemented by whileTrue/whileFalse
@@ -458,8 +514,8 @@ static int loadClassByName(lua_State * L)
     return 1;
 }
 
-LjObjectManager::LjObjectManager(Lua::Engine2* lua, QObject *parent) : QObject(parent),d_lua(lua),
-    d_genLua(false),d_genClosures(false)
+LjObjectManager::LjObjectManager(Lua::Engine2* lua, QObject *parent) : QObject(parent),d_lua(lua),d_nlrTokens(0),
+    d_genLua(false),d_genClosures(false),d_writeFiles(false),d_options(LjbcCompiler2::DefaultOptions)
 {
     Q_ASSERT( d_lua );
     _nil = Lexer::getSymbol("nil"); // instance of Nil
@@ -484,8 +540,17 @@ bool LjObjectManager::load(const QString& mainSomFile, const QStringList& paths)
 {
     d_errors.clear();
     d_mainClass.reset();
+    d_mainName.clear();
+    d_runSelector.clear();
     d_classes.clear();
     d_loadingOrder.clear();
+    d_images.clear();
+    d_parsed.clear();
+    d_selfBound.clear();
+    d_targets.clear();
+    d_nlrSelectors.clear();
+    d_nonEscaping.clear();
+    d_nlrTokens = 0;
     d_instantiated = 0;
     d_generated.clear();
 
@@ -502,26 +567,15 @@ bool LjObjectManager::load(const QString& mainSomFile, const QStringList& paths)
     }
     d_classPaths.append(home.absolutePath());
 
-    getOrLoadClass("Metaclass"); // instantiates Object, Class and some others; must be first!
-    getOrLoadClass("Class");
-    getOrLoadClass("System");
-    getOrLoadClass("Boolean");
-    getOrLoadClass("True");
-    getOrLoadClass("False");
-    getOrLoadClass("Nil");
-    getOrLoadClass("Block");
-    getOrLoadClass("String");
-    getOrLoadClass("Symbol");
-    getOrLoadClass("Integer");
-    getOrLoadClass("Double");
-    getOrLoadClass("Array");
-    getOrLoadClass("Method");
-    getOrLoadClass("Primitive");
+    if( loadFromCache() )
+        return d_errors.isEmpty() && defineRunSom();
 
-    // We have to load an parse all classes provided in the path; otherwise we would have to detect
-    // a missing class at runtime and then compile it
-    if( !parseMain(mainSomFile) )
+    parseAll();
+    if( !loadClasses() )
+    {
+        d_parsed.clear();
         return false;
+    }
 
 #if 0
     foreach( Ast::Class* c, d_loadingOrder )
@@ -535,30 +589,65 @@ bool LjObjectManager::load(const QString& mainSomFile, const QStringList& paths)
     }
 #endif
 
-    instantiateClasses();
+    d_mainName = d_mainClass->d_name;
+    d_runSelector = "run";
+    if( d_mainClass->findMethod( Lexer::getSymbol("run") ) == 0 )
+        d_runSelector += "_";
+
+    const bool ok = instantiateClasses();
+    d_parsed.clear(); // the classes not used by the program; loadAtRuntime reads the file again
+    if( ok )
+        saveToCache();
+
+    return defineRunSom();
+}
+
+static const char* s_coreClasses[] = { "Metaclass", "Class", "System", "Boolean", "True", "False", "Nil", "Block",
+                                       "String", "Symbol", "Integer", "Double", "Array", "Method", "Primitive", 0 };
+
+bool LjObjectManager::loadClasses()
+{
+    // Metaclass instantiates Object, Class and some others; must be first!
+    for( int i = 0; s_coreClasses[i]; i++ )
+        getOrLoadClass(s_coreClasses[i]);
+
+    // We have to load an parse all classes provided in the path; otherwise we would have to detect
+    // a missing class at runtime and then compile it
+    return parseMain(d_mainPath);
+}
 
+bool LjObjectManager::defineRunSom()
+{
     QByteArray code;
     QTextStream out(&code);
 
     // create default args, will be overwritten by actual args later
     out << "somArgs = _primitives._inst(Array)" << endl;
-    out << "somArgs:at_put_(1,_primitives._newString(\"" << d_mainClass->d_loc.d_source.toUtf8() << "\"))" << endl;
+    out << "somArgs:at_put_(1,_primitives._newString(\"" << d_mainPath.toUtf8() << "\"))" << endl;
 
-    QByteArray run = "run";
-    if( d_mainClass->findMethod( Lexer::getSymbol("run") ) == 0 )
-        run += "_";
-    out << "function runSom() " << d_mainClass->d_name << "._class:" << run << "(somArgs) end" << endl;
+    out << "function runSom() " << d_mainName << "._class:" << d_runSelector << "(somArgs) end" << endl;
 
     out.flush();
     if( !d_lua->executeCmd( code ) )
        d_errors += d_lua->getLastError();
 
+    lua_State* L = d_lua->getCtx();
+    lua_pushnil(L);
+    while( lua_next( L, LUA_GLOBALSINDEX ) != 0 )
+    {
+        if( lua_type(L,-2) == LUA_TSTRING )
+            d_runtimeGlobals << lua_tostring(L,-2);
+        lua_pop(L,1);
+    }
+
     return d_errors.isEmpty();
 }
 
 bool LjObjectManager::loadAtRuntime(const QByteArray& className)
 {
     d_errors.clear();
+    if( d_loadingOrder.isEmpty() && !d_images.isEmpty() && !restoreAsts() )
+        return false;
     if( getOrLoadClass(className).isNull() )
         return false;
     if( !instantiateClasses() )
@@ -571,12 +660,12 @@ bool LjObjectManager::setArgs(const QStringList& args)
     QByteArray code;
     QTextStream out(&code);
     out << "somArgs = _primitives._inst(Array)" << endl;
-    out << "somArgs:at_put_(1,_primitives._newString(\"" << d_mainClass->d_loc.d_source.toUtf8() << "\"))" << endl;
+    out << "somArgs:at_put_(1,_primitives._newString(\"" << d_mainPath.toUtf8() << "\"))" << endl;
     for( int i = 0; i < args.size(); i++ )
         out << "somArgs:at_put_(" << i+2 << ",_primitives._newString(\"" << args[i].toUtf8() << "\"))" << endl;
     out.flush();
 
-    if( ! d_lua->executeCmd( code ) );
+    if( !d_lua->executeCmd( code ) )
        d_errors += d_lua->getLastError();
     return d_errors.isEmpty();
 }
@@ -605,8 +694,8 @@ void LjObjectManager::generateSomPrimitives()
 QByteArrayList LjObjectManager::getClassNames() const
 {
     QByteArrayList res;
-    for(int i = 0; i < d_loadingOrder.size(); i++ )
-        res += d_loadingOrder[i]->d_name;
+    for(int i = 0; i < d_images.size(); i++ )
+        res += d_images[i].d_name;
     return res;
 }
 
@@ -626,15 +715,21 @@ bool LjObjectManager::parseMain(const QString& mainFile)
     return handleUnresolved();
 }
 
-Ast::Ref<Ast::Class> LjObjectManager::parseFile(const QString& file)
+static QString errorMessage(const Ast::Loc& loc, const QString& msg)
+{
+    return QString("%1:%2:%3: %4").arg( QFileInfo(loc.d_source).baseName() )
+            .arg(loc.d_line).arg(loc.d_col).arg(msg);
+}
+
+static Ast::Ref<Ast::Class> parseClass(const QString& file, QStringList& errors)
 {
+    // doesn't touch the state of the object manager, so it can run in parallel
     QFile in(file);
     if( !in.open(QIODevice::ReadOnly) )
     {
-        error( tr("cannot open file for reading '%1'").arg(file) );
+        errors << LjObjectManager::tr("cannot open file for reading '%1'").arg(file);
         return 0;
     }
-    const quint32 errCountBefore = d_errors.size();
     Lexer lex;
     lex.setDevice(&in,file);
     lex.setEatComments(true);
@@ -642,19 +737,155 @@ Ast::Ref<Ast::Class> LjObjectManager::parseFile(const QString& file)
     if( !p.readFile() )
     {
         foreach( const Parser::Error& e, p.getErrs() )
-            error(e.d_loc,e.d_msg);
+            errors << errorMessage(e.d_loc,e.d_msg);
     }
 
-    if( d_errors.size() != errCountBefore )
+    if( !errors.isEmpty() )
         return 0;
 
     return p.getClass();
 }
 
+Ast::Ref<Ast::Class> LjObjectManager::parseFile(const QString& file)
+{
+    QHash<QString,Parsed>::iterator i = d_parsed.find(file);
+    if( i != d_parsed.end() )
+    {
+        // parsed in advance; the errors are only reported if the class is actually used
+        const Parsed res = i.value();
+        d_parsed.erase(i);
+        d_errors += res.d_errors;
+        return res.d_class;
+    }
+    QStringList errors;
+    Ast::Ref<Ast::Class> res = parseClass(file, errors);
+    d_errors += errors;
+    return res;
+}
+
+struct FindNames : public Visitor
+{
+    // collects all identifiers of a class; the ones not resolved to a variable are loaded as classes
+    QSet<QByteArray>& names;
+    FindNames(QSet<QByteArray>& n):names(n){}
+
+    void visit( Class* c )
+    {
+        names << c->d_superName;
+        for( int i = 0; i < c->d_methods.size(); i++ )
+            c->d_methods[i]->accept(this);
+    }
+    void visit( Method* m )
+    {
+        for( int i = 0; i < m->d_body.size(); i++ )
+            m->d_body[i]->accept(this);
+    }
+    void visit( Block* b )
+    {
+        for( int i = 0; i < b->d_func->d_body.size(); i++ )
+            b->d_func->d_body[i]->accept(this);
+    }
+    void visit( MsgSend* s )
+    {
+        s->d_receiver->accept(this);
+        for( int i = 0; i < s->d_args.size(); i++ )
+            s->d_args[i]->accept(this);
+    }
+    void visit( Return* r )
+    {
+        r->d_what->accept(this);
+    }
+    void visit( Assig* a )
+    {
+        a->d_rhs->accept(this);
+    }
+    void visit( ArrayLiteral* a )
+    {
+        for( int i = 0; i < a->d_elements.size(); i++ )
+            a->d_elements[i]->accept(this);
+    }
+    void visit( Ident* i )
+    {
+        names << i->d_ident;
+    }
+};
+
+class LjObjectManager::ParseJob : public QRunnable
+{
+public:
+    ParseJob( const QString& file, Parsed* res ):d_file(file),d_res(res) {}
+    void run()
+    {
+        d_res->d_class = parseClass( d_file, d_res->d_errors );
+        if( !d_res->d_class.isNull() )
+        {
+            FindNames v(d_res->d_names);
+            d_res->d_class->accept(&v);
+        }
+    }
+private:
+    QString d_file;
+    Parsed* d_res;
+};
+
+void LjObjectManager::parseAll()
+{
+    // Lexing and parsing of the class files is independent of each other, so the files which getOrLoadClassImp
+    // will look for are parsed in parallel up-front, starting with the main file and the core classes, then the
+    // files of the names used by these, and so on; resolving and linking the classes still happens one by one in
+    // dependency order, and so does the instantiation in Lua. A file missed here is parsed when it is loaded.
+    QHash<QByteArray,QString> paths; // class name -> file, as findClassFile would find it
+    for( int i = 0; i < d_classPaths.size(); i++ )
+    {
+        const QDir dir( d_classPaths[i] );
+        const QStringList som = dir.entryList( QStringList() << "*.som", QDir::Files );
+        for( int j = 0; j < som.size(); j++ )
+            paths[ QFileInfo(som[j]).completeBaseName().toUtf8() ] = dir.absoluteFilePath(som[j]);
+    }
+    const QString mainFile = QFileInfo(d_mainPath).absoluteFilePath();
+    QSet<QString> seen;
+    seen << mainFile;
+    QStringList files;
+    files << d_mainPath;
+    for( int i = 0; s_coreClasses[i]; i++ )
+    {
+        const QString path = paths.value(s_coreClasses[i]);
+        if( !path.isEmpty() && !seen.contains(path) )
+        {
+            seen << path;
+            files << path;
+        }
+    }
+
+    while( !files.isEmpty() )
+    {
+        QVector<Parsed> res( files.size() );
+        QThreadPool pool;
+        for( int i = 0; i < files.size(); i++ )
+            pool.start( new ParseJob( files[i], &res[i] ) );
+        pool.waitForDone();
+
+        QStringList next;
+        for( int i = 0; i < files.size(); i++ )
+        {
+            d_parsed.insert( files[i], res[i] );
+            foreach( const QByteArray& name, res[i].d_names )
+            {
+                const QString path = paths.value(name);
+                if( !path.isEmpty() && !seen.contains(path) )
+                {
+                    seen << path;
+                    next << path;
+                }
+            }
+        }
+        files = next;
+    }
+}
+
 bool LjObjectManager::error(const Ast::Loc& loc, const QString& msg)
 {
-    return error( QString("%1:%2:%3: %4").arg( QFileInfo(loc.d_source).baseName() )
-            .arg(loc.d_line).arg(loc.d_col).arg(msg) );
+    return error( errorMessage(loc,msg) );
 }
 
 bool LjObjectManager::error(const QString& msg)
@@ -802,6 +1033,12 @@ static QSet<QByteArray> methodNamesOf(Ast::Class* cls, bool classLevel )
     return res;
 }
 
+static bool dnuKeepsArgs( const QHash<QByteArray,quint32>& nonEscaping )
+{
+    // the second arg of doesNotUnderstand:arguments: is the Array with the args of the send not understood
+    return !( nonEscaping.value( Lexer::getSymbol("doesNotUnderstand:arguments:") ) & 2 );
+}
+
 bool LjObjectManager::instantiateClasses()
 {
     const int top = lua_gettop(d_lua->getCtx());
@@ -810,74 +1047,42 @@ bool LjObjectManager::instantiateClasses()
     const int oldInstantiated = d_instantiated;
     while( d_instantiated < d_loadingOrder.size() )
     {
-        instantiateClass( d_loadingOrder[ d_instantiated ] );
-        if( firstRun && d_loadingOrder[d_instantiated]->d_name.constData() == _Class.constData() )
+        d_images.append( imageOf( d_loadingOrder[ d_instantiated ] ) );
+        instantiateClass( d_images.last() );
+        if( firstRun && d_images.last().d_name == _Class )
         {
-            lua_State* L = d_lua->getCtx();
             Q_ASSERT( d_instantiated == 1 ); // Class comes directly after Object
-            lua_getglobal( L, _Object.constData() );
-            Q_ASSERT( !lua_isnil(L,-1) );
-            const int objectMeta = lua_gettop(L);
-            lua_getglobal( L, _Class.constData() );
-            Q_ASSERT( !lua_isnil(L,-1) );
-            const int classMeta = lua_gettop(L);
-            lua_getfield( L, classMeta, "_class" );
-            Q_ASSERT( !lua_isnil( L, -1 ) );
-            const int _class = lua_gettop(L);
-            lua_pushvalue( L, _class);
-            lua_setfield( L, objectMeta, "_super" ); // Object -> nil, Object Meta -> Class
-
-            QSet<QByteArray> classMethodNames = methodNamesOf( d_loadingOrder[d_instantiated], false);
-            QSet<QByteArray>::const_iterator i;
-            for( i = classMethodNames.begin(); i != classMethodNames.end(); ++i )
-            {
-                const QByteArray name = LuaTranspiler::map(*i);
-                lua_getfield( L, _class, name.constData() );
-                lua_setfield( L, objectMeta, name.constData() );
-            }
-            // NOTE: Object has no class methods, so we don't overwrite something
-
-            lua_pop(L,3); // objectMeta, classMeta, _class
+            connectObjectMeta( d_images.last() );
         }
         d_instantiated++;
     }
 
     if( firstRun )
+        connectValueTypes();
+
+    // the new classes can add selectors which return non-locally
+    const QSet<QByteArray> nlrSelectors = nonLocalReturnSelectors();
+    QSet<QByteArray> changed = QSet<QByteArray>(nlrSelectors).subtract(d_nlrSelectors);
+    d_nlrSelectors = nlrSelectors;
+
+    // and implementations which keep block arguments, also doesNotUnderstand:arguments: for all selectors
+    const QHash<QByteArray,quint32> nonEscaping = nonEscapingArgs();
+    const bool dnuKept = !dnuKeepsArgs(d_nonEscaping) && dnuKeepsArgs(nonEscaping);
+    QHash<QByteArray,quint32>::const_iterator j;
+    for( j = d_nonEscaping.begin(); j != d_nonEscaping.end(); ++j )
     {
-        lua_State* L = d_lua->getCtx();
-
-        lua_pushnil(L);
-        lua_getglobal( L, "Nil" );
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_getfield( L, -1, "_class" );
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_setmetatable(L,-3);
-        lua_pop(L,2);
-
-        lua_pushnumber(L,0);
-        lua_getglobal( L, "Integer" );
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_getfield( L, -1, "_class" );
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_setmetatable(L,-3);
-        lua_pop(L,2);
+        if( dnuKept || ( j.value() & ~nonEscaping.value(j.key()) ) )
+            changed << j.key();
+    }
+    d_nonEscaping = nonEscaping;
 
-        lua_pushboolean(L,true);
-        lua_getglobal( L, "Boolean" ); // NOTE: originally True and False, but we use modified Boolean instead
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_getfield( L, -1, "_class" );
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_setmetatable(L,-3);
-        lua_pop(L,2);
-
-        lua_createtable(L,0,0);
-        lua_pushvalue(L,-1);
-        lua_setglobal(L,"system");
-        lua_getglobal(L,"System");
-        lua_getfield( L, -1, "_class" );
-        Q_ASSERT( !lua_isnil( L, -1 ) );
-        lua_setmetatable(L,-3);
-        lua_pop(L,2);
+    if( !firstRun )
+    {
+        // recompile the classes which called methods directly which are now overridden by a new subclass, or which
+        // don't check for non-local returns which are now possible, or which reuse blocks which can now escape
+        const QList<Ast::Class*> invalid = invalidatedBy( oldInstantiated, changed );
+        for( int i = 0; i < invalid.size(); i++ )
+            compileMethods( invalid[i] );
     }
 
     for( int i = oldInstantiated; i < d_loadingOrder.size(); i++ )
@@ -887,6 +1092,80 @@ bool LjObjectManager::instantiateClasses()
     return d_errors.isEmpty();
 }
 
+void LjObjectManager::connectObjectMeta(const ClassImage& cls)
+{
+    lua_State* L = d_lua->getCtx();
+    lua_getglobal( L, _Object.constData() );
+    Q_ASSERT( !lua_isnil(L,-1) );
+    const int objectMeta = lua_gettop(L);
+    lua_getglobal( L, cls.d_name.constData() );
+    Q_ASSERT( !lua_isnil(L,-1) );
+    const int classMeta = lua_gettop(L);
+    lua_getfield( L, classMeta, "_class" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    const int _class = lua_gettop(L);
+    lua_pushvalue( L, _class);
+    lua_setfield( L, objectMeta, "_super" ); // Object -> nil, Object Meta -> Class
+
+    const QByteArrayList classMethodNames = cls.d_inherited + cls.d_methods;
+    for( int i = 0; i < classMethodNames.size(); i++ )
+    {
+        const QByteArray& name = classMethodNames[i];
+        lua_getfield( L, _class, name.constData() );
+        lua_setfield( L, objectMeta, name.constData() );
+    }
+    // NOTE: Object has no class methods, so we don't overwrite something
+
+    lua_pop(L,3); // objectMeta, classMeta, _class
+}
+
+void LjObjectManager::connectValueTypes()
+{
+    lua_State* L = d_lua->getCtx();
+
+    lua_pushnil(L);
+    lua_getglobal( L, "Nil" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_getfield( L, -1, "_class" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_setmetatable(L,-3);
+    lua_pop(L,2);
+
+    lua_pushnumber(L,0);
+    lua_getglobal( L, "Integer" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_getfield( L, -1, "_class" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_setmetatable(L,-3);
+    lua_pop(L,2);
+
+    lua_pushboolean(L,true);
+    lua_getglobal( L, "Boolean" ); // NOTE: originally True and False, but we use modified Boolean instead
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_getfield( L, -1, "_class" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_setmetatable(L,-3);
+    lua_pop(L,2);
+
+    // Doubles are FFI structs; their ctype gets a metatable referring to the Double class
+    lua_getglobal( L, "_primitives" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_getfield( L, -1, "_initDouble" );
+    lua_getglobal( L, "Double" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_call( L, 1, 0 );
+    lua_pop(L,1);
+
+    lua_createtable(L,0,0);
+    lua_pushvalue(L,-1);
+    lua_setglobal(L,"system");
+    lua_getglobal(L,"System");
+    lua_getfield( L, -1, "_class" );
+    Q_ASSERT( !lua_isnil( L, -1 ) );
+    lua_setmetatable(L,-3);
+    lua_pop(L,2);
+}
+
 static QByteArrayList fieldsOf(Ast::Class* cls, bool classLevel )
 {
     QByteArrayList res;
@@ -905,14 +1184,54 @@ static QByteArrayList fieldsOf(Ast::Class* cls, bool classLevel )
     return res;
 }
 
-bool LjObjectManager::instantiateClass(Ast::Class* cls)
+static QByteArrayList mappedNamesOf(const QSet<QByteArray>& names)
+{
+    QByteArrayList res;
+    QSet<QByteArray>::const_iterator i;
+    for( i = names.begin(); i != names.end(); ++i )
+        res << LuaTranspiler::map(*i);
+    return res;
+}
+
+LjObjectManager::ClassImage LjObjectManager::imageOf(Ast::Class* cls) const
+{
+    ClassImage res;
+    res.d_name = cls->d_name;
+    if( cls->d_superName.constData() != _nil.constData() )
+        res.d_superName = cls->d_superName;
+    res.d_source = cls->d_loc.d_source;
+    res.d_fields = fieldsOf( cls, false );
+    res.d_classFields = fieldsOf( cls, true );
+    if( cls->d_owner )
+    {
+        Q_ASSERT( cls->d_owner->getTag() == Ast::Thing::T_Class );
+        res.d_inherited = mappedNamesOf( methodNamesOf(static_cast<Ast::Class*>(cls->d_owner), false) );
+        res.d_classInherited = mappedNamesOf( methodNamesOf(static_cast<Ast::Class*>(cls->d_owner), true) );
+    }
+    for( int i = 0; i < cls->d_methods.size(); i++ )
+    {
+        Ast::Method* m = cls->d_methods[i].data();
+        if( !m->d_classLevel )
+            res.d_methods << LuaTranspiler::map(m->d_name);
+        if( m->d_primitive )
+        {
+            QByteArray fromName = m->d_name;
+            if( m->d_classLevel )
+                fromName = "^" + fromName; // class level primitives are prefixed
+            res.d_primitives << qMakePair( fromName, LuaTranspiler::map(m->d_name,m->d_patternType) );
+        }
+    }
+    return res;
+}
+
+bool LjObjectManager::instantiateClass(const ClassImage& cls)
 {
     lua_State* L = d_lua->getCtx();
 
-    lua_getglobal( L, cls->d_name.constData() );
+    lua_getglobal( L, cls.d_name.constData() );
     if( !lua_isnil( L, -1 ) )
     {
-        error( tr("class '%1' already instantiated").arg(cls->d_name.constData()) );
+        error( tr("class '%1' already instantiated").arg(cls.d_name.constData()) );
         lua_pop(L,1);
         return false;
     }
@@ -928,31 +1247,31 @@ bool LjObjectManager::instantiateClass(Ast::Class* cls)
     lua_setfield( L, classT, "_meta");
 
     lua_pushvalue( L, metaT );
-    lua_setglobal( L, cls->d_name.constData() );
+    lua_setglobal( L, cls.d_name.constData() );
 
-    lua_pushstring( L, cls->d_name.constData() );
+    lua_pushstring( L, cls.d_name.constData() );
     lua_setfield( L, classT, "_name" );
 
-    lua_pushstring( L, ( cls->d_name + " class" ).constData() );
+    lua_pushstring( L, ( cls.d_name + " class" ).constData() );
     lua_setfield( L, metaT, "_name" );
 
     lua_pushvalue( L, classT );
     lua_setfield( L, metaT, "_class" );
 
 #if 0
-    qDebug() << "Class" << cls->d_name << lua_topointer( L, classT );
-    qDebug() << "Meta" << cls->d_name << lua_topointer( L, metaT );
+    qDebug() << "Class" << cls.d_name << lua_topointer( L, classT );
+    qDebug() << "Meta" << cls.d_name << lua_topointer( L, metaT );
 #endif
 
     lua_pushvalue( L, classT );
     lua_setfield( L, classT, "__index" ); // instances of class can access the methods in classT
     // not needed on meta level because there are no direct instances
 
-    if( cls->d_superName.constData() != _nil.constData() )
+    if( !cls.d_superName.isEmpty() )
     {
         // this is anything below Object
 
-        lua_getglobal( L, cls->d_superName.constData() );
+        lua_getglobal( L, cls.d_superName.constData() );
         const int superMetaT = lua_gettop(L);
         Q_ASSERT( !lua_isnil(L,superMetaT) );
         lua_getfield( L, superMetaT, "_class" );
@@ -964,30 +1283,28 @@ bool LjObjectManager::instantiateClass(Ast::Class* cls)
         lua_setfield( L, classT, "_super" );
 
 #if 0
-        qDebug() << "Super of Class" << cls->d_name << lua_topointer( L, classT )
-                << "Class" << cls->d_superName << lua_topointer( L, superT );
-        qDebug() << "Super of Meta" << cls->d_name << lua_topointer( L, metaT )
-                 << "Meta" << cls->d_superName << lua_topointer( L, superMetaT );
+        qDebug() << "Super of Class" << cls.d_name << lua_topointer( L, classT )
+                << "Class" << cls.d_superName << lua_topointer( L, superT );
+        qDebug() << "Super of Meta" << cls.d_name << lua_topointer( L, metaT )
+                 << "Meta" << cls.d_superName << lua_topointer( L, superMetaT );
 #endif
         lua_pop( L, 1 ); // superT
         lua_pop( L, 1 ); // superMetaT
 
-        QByteArrayList fields = fieldsOf( cls, false );
         lua_createtable( L, 0, 0 );
         int ft = lua_gettop(L);
-        for( int i = 0; i < fields.size(); i++ )
+        for( int i = 0; i < cls.d_fields.size(); i++ )
         {
-            lua_pushstring( L, fields[i].constData() );
+            lua_pushstring( L, cls.d_fields[i].constData() );
             lua_rawseti( L, ft, i+1 );
         }
         lua_setfield( L, classT, "_fields" );
 
-        fields = fieldsOf( cls, true );
         lua_createtable( L, 0, 0 );
         ft = lua_gettop(L);
-        for( int i = 0; i < fields.size(); i++ )
+        for( int i = 0; i < cls.d_classFields.size(); i++ )
         {
-            lua_pushstring( L, fields[i].constData() );
+            lua_pushstring( L, cls.d_classFields[i].constData() );
             lua_rawseti( L, ft, i+1 );
         }
         lua_setfield( L, metaT, "_fields" );
@@ -996,6 +1313,15 @@ bool LjObjectManager::instantiateClass(Ast::Class* cls)
     lua_pop(L,1); // metaT
     lua_pop(L,1); // classT
 
+    return true;
+}
+
+bool LjObjectManager::compileMethods(Ast::Class* cls)
+{
+    const int i = d_loadingOrder.indexOf(cls);
+    Q_ASSERT( i >= 0 && i < d_images.size() );
+    ClassImage& img = d_images[i];
+
 #if 0
     QFile out( pathInDir("Ast",  cls->d_name + ".txt" ) );
     if( !out.open(QIODevice::WriteOnly) )
@@ -1004,14 +1330,40 @@ bool LjObjectManager::instantiateClass(Ast::Class* cls)
     cls->dump(ts);
 #endif
 
-    return true;
+    assignNlrTokens(cls);
+
+    img.d_code.clear();
+    QBuffer out( &img.d_code );
+    out.open(QIODevice::WriteOnly);
+    if( d_genLua )
+        writeLua( &out, cls );
+    else
+        writeBc( &out, cls );
+    out.close();
+    img.d_selfBound = d_selfBound.value(cls).toList();
+    img.d_targets.clear();
+    foreach( Class* target, d_targets.value(cls) )
+        img.d_targets << target->d_name;
+
+    return installClass(img);
 }
 
-bool LjObjectManager::compileMethods(Ast::Class* cls)
+void LjObjectManager::assignNlrTokens(Class* cls)
+{
+    for( int i = 0; i < cls->d_methods.size(); i++ )
+    {
+        // dense tokens instead of addresses make the generated code independent of the run
+        Ast::Method* m = cls->d_methods[i].data();
+        if( m->d_hasNonLocalReturnIfInlined && m->d_nlrToken == 0 )
+            m->d_nlrToken = ++d_nlrTokens;
+    }
+}
+
+bool LjObjectManager::installClass(const ClassImage& cls)
 {
     lua_State* L = d_lua->getCtx();
 
-    lua_getglobal( L, cls->d_name.constData() );
+    lua_getglobal( L, cls.d_name.constData() );
     const int metaT = lua_gettop(L);
     Q_ASSERT( !lua_isnil(L,metaT) );
     lua_getfield( L, metaT, "_class" );
@@ -1025,11 +1377,11 @@ bool LjObjectManager::compileMethods(Ast::Class* cls)
     lua_setmetatable( L, metaT ); // Metaclass is metatable of metaT, even if classT=Metaclass
     lua_pop(L,1);
 
-    if( cls->d_superName.constData() != _nil.constData() )
+    if( !cls.d_superName.isEmpty() )
     {
         // this is anything below Object
 
-        lua_getglobal( L, cls->d_superName.constData() );
+        lua_getglobal( L, cls.d_superName.constData() );
         const int superMetaT = lua_gettop(L);
         Q_ASSERT( !lua_isnil(L,superMetaT) );
         lua_getfield( L, superMetaT, "_class" );
@@ -1038,23 +1390,19 @@ bool LjObjectManager::compileMethods(Ast::Class* cls)
 
         // copy methods of superclass to this class
         // class
-        Q_ASSERT( cls->d_owner && cls->d_owner->getTag() == Ast::Thing::T_Class );
-        QSet<QByteArray> superMethodNames = methodNamesOf(static_cast<Ast::Class*>(cls->d_owner), false);
-        QSet<QByteArray>::const_iterator i;
-        for( i = superMethodNames.begin(); i != superMethodNames.end(); ++i )
+        for( int i = 0; i < cls.d_inherited.size(); i++ )
         {
             // all methods of all superclasses are copied to the class
-            const QByteArray name = LuaTranspiler::map(*i);
+            const QByteArray& name = cls.d_inherited[i];
             lua_getfield( L, superT, name.constData() );
             lua_setfield( L, classT, name.constData() );
         }
         lua_pop( L, 1 ); // superT
 
         // metaclass
-        superMethodNames = methodNamesOf(static_cast<Ast::Class*>(cls->d_owner), true);
-        for( i = superMethodNames.begin(); i != superMethodNames.end(); ++i )
+        for( int i = 0; i < cls.d_classInherited.size(); i++ )
         {
-            const QByteArray name = LuaTranspiler::map(*i);
+            const QByteArray& name = cls.d_classInherited[i];
             lua_getfield( L, superMetaT, name.constData() );
             lua_setfield( L, metaT, name.constData() );
         }
@@ -1067,7 +1415,7 @@ bool LjObjectManager::compileMethods(Ast::Class* cls)
     lua_getglobal( L, "_primitives" );
     if( !lua_isnil(L,-1) )
     {
-        lua_getfield( L, -1, cls->d_name.constData() );
+        lua_getfield( L, -1, cls.d_name.constData() );
         if( lua_isnil(L,-1) )
             lua_pop(L,1);
         else
@@ -1075,46 +1423,42 @@ bool LjObjectManager::compileMethods(Ast::Class* cls)
     }
     const int primitivesT = lua_gettop(L);
 
-    QFile out( pathInDir( "Lua", cls->d_name + ".lua" ) );
-    d_generated << qMakePair(cls->d_loc.d_source, out.fileName() );
-    out.open(QIODevice::WriteOnly);
-
-    for( int i = 0; i < cls->d_methods.size(); i++ )
+    for( int i = 0; i < cls.d_primitives.size(); i++ )
     {
-        Ast::Method* m = cls->d_methods[i].data();
-        if( m->d_primitive )
-        {
-            const QByteArray toName = LuaTranspiler::map(m->d_name,m->d_patternType);
-            QByteArray fromName = m->d_name;
-            if( m->d_classLevel )
-                fromName = "^" + fromName; // class level primitives are prefixed
-            // copy the method from the Primitives implementation (even nil)
-            lua_getfield(L,primitivesT, fromName.constData() );
+        const QByteArray& fromName = cls.d_primitives[i].first;
+        const QByteArray& toName = cls.d_primitives[i].second;
+        // copy the method from the Primitives implementation (even nil)
+        lua_getfield(L,primitivesT, fromName.constData() );
 #if 0
-            if( lua_isnil(L,-1) )
-                qWarning() << "primitive" << cls->d_name << m->d_name << "not implemented";
+        if( lua_isnil(L,-1) )
+            qWarning() << "primitive" << cls.d_name << fromName << "not implemented";
 #endif
 
-            if( m->d_classLevel )
-                lua_setfield(L,metaT,toName.constData() );
-            else
-                lua_setfield(L,classT,toName.constData() );
-        }
+        if( fromName.startsWith('^') )
+            lua_setfield(L,metaT,toName.constData() );
+        else
+            lua_setfield(L,classT,toName.constData() );
     }
 
-    if( d_genLua )
-        writeLua( &out, cls );
-    else
-        writeBc( &out, cls );
-
-    out.close();
-
     lua_pop(L,1); // primitivesT
     lua_pop(L,1); // metaT
     lua_pop(L,1); // classT
 
+    // the chunk is loaded from memory; the file is only written on request, e.g. for the IDE
+    QByteArray chunk = "=" + cls.d_name + ".lua";
+    if( d_writeFiles )
+    {
+        QFile f( pathInDir( "Lua", cls.d_name + ".lua" ) );
+        if( !d_generated.contains( qMakePair(cls.d_source, f.fileName() ) ) )
+            d_generated << qMakePair(cls.d_source, f.fileName() ); // not again if recompiled
+        if( !f.open(QIODevice::WriteOnly) || f.write(cls.d_code) != cls.d_code.size() )
+            qWarning() << "cannot write" << f.fileName();
+        chunk = "@" + f.fileName().toUtf8();
+    }
+
 #if 1
-    if( luaL_dofile( L, out.fileName().toUtf8().constData() ) != 0 )
+    if( luaL_loadbuffer( L, cls.d_code.constData(), cls.d_code.size(), chunk.constData() ) != 0 ||
+            lua_pcall( L, 0, 0, 0 ) != 0 )
     {
          error( lua_tostring(L, -1) );
          lua_pop( L, 1 );
@@ -1159,8 +1503,8 @@ void LjObjectManager::writeLua(QIODevice* out, Class* cls)
 
 static quint8 nextFreeSlot( Lua::JitComposer::SlotPool& pool, const Loc& loc )
 {
-    const int slot = Lua::JitComposer::nextFreeSlot(pool,1);
-    if( slot < 0 )
+    int slot;
+    if( !LjbcCompiler2::Module::takeSlot(pool,&slot) )
     {
         qCritical() << loc.d_source << ":" << loc.d_line << ":" << loc.d_col << ":" << "run out of block function slots";
         throw NoMoreFreeSlots(loc);
@@ -1169,19 +1513,37 @@ static quint8 nextFreeSlot( Lua::JitComposer::SlotPool& pool, const Loc& loc )
     return slot;
 }
 
-static bool writeBlock( Lua::JitComposer& bc, Method* m, Block* b, Lua::JitComposer::SlotPool& pool )
+static bool writeBlock( Lua::JitComposer& bc, Method* m, Block* b, LjbcCompiler2::Module& mod )
 {
     // compile from inner to outer because outer refer to inner!
     for( int j = 0; j < b->d_func->d_blocks.size(); j++ )
     {
-        if( !writeBlock( bc, m, b->d_func->d_blocks[j], pool ) )
+        if( !writeBlock( bc, m, b->d_func->d_blocks[j], mod ) )
             return false;
     }
     if( !b->d_func->d_inline )
     {
-        b->d_func->d_slot = nextFreeSlot(pool,b->d_loc);
+        b->d_func->d_slot = nextFreeSlot(mod.d_pool,b->d_loc);
         b->d_func->d_slotValid = true;
-        LjbcCompiler2::translate(bc, m, b);
+        LjbcCompiler2::translate(bc, mod, m, b);
+        const bool reused = mod.d_reused.contains(b);
+        if( reused || static_cast<Class*>(m->d_owner)->d_relocated.contains(b->d_func.data()) )
+        {
+            // the block depends on no enclosing function, so a single instance replaces the function in its slot;
+            // reused blocks get the param tables of the enclosing functions when passed, see LjBcGen2::reuseBlock
+            const int inst = bc.nextFreeSlot(mod.d_pool,1);
+            bc.TNEW( inst, reused ? b->d_func->d_inlinedLevel : 0, 1, b->d_loc.packed() );
+            bc.TSET( b->d_func->d_slot, inst, "_f", b->d_loc.packed() );
+            const int args = bc.nextFreeSlot(mod.d_pool,3,true);
+            bc.GGET( args, "setmetatable", b->d_loc.packed() );
+            bc.MOV( args+1, inst, b->d_loc.packed() );
+            bc.GGET( args+2, "Block", b->d_loc.packed() );
+            bc.TGET( args+2, args+2, "_class", b->d_loc.packed() );
+            bc.CALL( args, 0, 2, b->d_loc.packed() );
+            bc.releaseSlot(mod.d_pool,args,3);
+            bc.MOV( b->d_func->d_slot, inst, b->d_loc.packed() );
+            bc.releaseSlot(mod.d_pool,inst);
+        }
 #if 0
         const int c = nextFreeSlot(pool,b->d_loc);
         bc.GGET( c, m->d_owner->d_name, b->d_loc.packed() );
@@ -1200,6 +1562,19 @@ void LjObjectManager::writeBc(QIODevice* out, Class* cls)
 
     bc.openFunction(0,cls->d_loc.d_source.toUtf8(),cls->d_loc.packed(), cls->d_end.packed() );
     Lua::JitComposer::SlotPool pool;
+    LjbcCompiler2::Module mod(pool, d_options);
+    QList<Method*> customized;
+    if( !d_genClosures && ( d_options & LjbcCompiler2::Customize ) && ( d_options & LjbcCompiler2::Devirtualize ) )
+        customized = customizedMethods( cls );
+    if( !d_genClosures && ( d_options & ( LjbcCompiler2::Devirtualize | LjbcCompiler2::InlineMethods ) ) )
+        bindSends( cls, mod, customized );
+    if( !d_genClosures )
+        bindSuperSends( cls, mod );
+    if( d_options & LjbcCompiler2::NlrAnalysis )
+        mod.d_nlrSelectors = &d_nlrSelectors;
+    mod.d_integerPrimitives = hasIntegerPrimitives();
+    if( !d_genClosures && ( d_options & LjbcCompiler2::ReuseBlocks ) )
+        findReusedBlocks( cls, mod );
 
     // class.__unm = _primitives.__unm // each instance becomes convertible to a number
     int slot = bc.nextFreeSlot(pool,2);
@@ -1219,12 +1594,12 @@ void LjObjectManager::writeBc(QIODevice* out, Class* cls)
             {
                 for( int j = 0; j < m->d_blocks.size(); j++ )
                 {
-                    if( !writeBlock( bc, m, m->d_blocks[j], pool ) )
+                    if( !writeBlock( bc, m, m->d_blocks[j], mod ) )
                         break;
                 }
                 m->d_slot = nextFreeSlot(pool,m->d_end);
                 m->d_slotValid = true;
-                LjbcCompiler2::translate(bc, m);
+                LjbcCompiler2::translate(bc, mod, m);
                 // add the function to the metaclass or class table
                 const int c = nextFreeSlot(pool,m->d_end);
                 bc.GGET( c, m->d_owner->d_name, m->d_end.packed() );
@@ -1239,6 +1614,25 @@ void LjObjectManager::writeBc(QIODevice* out, Class* cls)
         }
     }
 
+    for( int i = 0; i < customized.size(); i++ )
+    {
+        // an inherited method compiled for this class replaces the copy of the superclass method
+        Ast::Method* m = customized[i];
+        for( int j = 0; j < m->d_blocks.size(); j++ )
+        {
+            if( !writeBlock( bc, m, m->d_blocks[j], mod ) )
+                break;
+        }
+        m->d_slot = nextFreeSlot(pool,m->d_end);
+        m->d_slotValid = true;
+        LjbcCompiler2::translate(bc, mod, m);
+        const int c = nextFreeSlot(pool,m->d_end);
+        bc.GGET( c, cls->d_name, m->d_end.packed() );
+        bc.TGET( c, c, "_class", m->d_end.packed() );
+        bc.TSET( m->d_slot, c,  LuaTranspiler::map(m->d_name,m->d_patternType), m->d_end.packed() );
+        bc.releaseSlot(pool,c);
+    }
+
 #if 0
     slot = bc.nextFreeSlot(pool,2,true);
     bc.GGET(slot,"print",cls->d_loc.packed());
@@ -1248,16 +1642,1449 @@ void LjObjectManager::writeBc(QIODevice* out, Class* cls)
 #endif
 
     if( !d_genClosures )
+    {
+        LjbcCompiler2::loadConsts(bc, mod, cls->d_end);
         bc.UCLO(0,0, cls->d_end.packed() );
+    }
 
     bc.RET(cls->d_loc.packed());
     bc.closeFunction(pool.d_frameSize);
-    bc.write(out);
+    if( d_options & LjbcCompiler2::Peephole )
+    {
+        QBuffer buf;
+        buf.open(QIODevice::WriteOnly);
+        bc.write(&buf);
+        QByteArray code = buf.data();
+        if( !LjbcPeephole::optimize(code) )
+            qWarning() << "bytecode of" << cls->d_name << "not optimized, unexpected format";
+        out->write(code);
+    }else
+        bc.write(out);
+}
+
+struct FindSends : public Visitor
+{
+    // collects the regular sends in all methods and blocks of a class and the selectors of all calls
+    QList<MsgSend*> sends;
+    QList<MsgSend*> supers; // the regular sends to super
+    QSet<QByteArray> selectors;
+    bool intoBlocks; // otherwise only the code executed by the method itself is visited
+    bool nonLocalReturn;
+    FindSends():intoBlocks(true),nonLocalReturn(false){}
+
+    void visit( Method* m )
+    {
+        for( int i = 0; i < m->d_body.size(); i++ )
+            m->d_body[i]->accept(this);
+    }
+    void visit( Block* b )
+    {
+        if( !intoBlocks && !b->d_func->d_inline )
+            return;
+        for( int i = 0; i < b->d_func->d_body.size(); i++ )
+            b->d_func->d_body[i]->accept(this);
+    }
+    void visit( MsgSend* s )
+    {
+        if( s->d_flowControl == NoFlowControl )
+        {
+            selectors << Lexer::getSymbol( s->prettyName(false) );
+            if( s->d_receiver->keyword() != Expression::_super )
+                sends << s;
+            else
+                supers << s;
+        }else if( s->d_flowControl >= ToDo )
+        {
+            // the inlined loops fall back to these sends
+            const bool down = s->d_flowControl == DownToDo || s->d_flowControl == DownToByDo;
+            selectors << Lexer::getSymbol( down ? ">=" : "<=" ) << Lexer::getSymbol( down ? "-" : "+" );
+        }
+        s->d_receiver->accept(this);
+        for( int i = 0; i < s->d_args.size(); i++ )
+            s->d_args[i]->accept(this);
+    }
+    void visit( Return* r )
+    {
+        if( r->d_nonLocalIfInlined )
+            nonLocalReturn = true;
+        r->d_what->accept(this);
+    }
+    void visit( Assig* a )
+    {
+        a->d_rhs->accept(this);
+    }
+    void visit( ArrayLiteral* a )
+    {
+        for( int i = 0; i < a->d_elements.size(); i++ )
+            a->d_elements[i]->accept(this);
+    }
+};
+
+static Method* findMethod( Class* cls, const QByteArray& name, bool classLevel )
+{
+    // corresponds to the lookup in the flattened method tables
+    while( cls )
+    {
+        const QList<Named*> methods = cls->d_methodNames.value(name.constData());
+        for( int i = 0; i < methods.size(); i++ )
+        {
+            Method* m = static_cast<Method*>(methods[i]);
+            if( m->d_classLevel == classLevel )
+                return m;
+        }
+        cls = cls->getSuper();
+    }
+    return 0;
+}
+
+static int inlineCost( Expression* e )
+{
+    // number of nodes or -1 if the expression cannot be inlined, i.e. if it refers to something else than self,
+    // params, fields, globals and literals
+    switch( e->getTag() )
+    {
+    case Thing::T_Number:
+    case Thing::T_Char:
+    case Thing::T_String:
+    case Thing::T_Symbol:
+        return 1;
+    case Thing::T_Ident:
+        {
+            Ident* id = static_cast<Ident*>(e);
+            if( id->d_keyword == Expression::_super || id->d_keyword == Expression::_primitive )
+                return -1;
+            if( id->d_resolved && id->d_resolved->getTag() == Thing::T_Variable &&
+                    static_cast<Variable*>(id->d_resolved)->d_kind == Variable::Temporary )
+                return -1;
+            return 1;
+        }
+    case Thing::T_Assig:
+        {
+            Assig* a = static_cast<Assig*>(e);
+            if( a->d_lhs->d_resolved == 0 || a->d_lhs->d_resolved->getTag() != Thing::T_Variable )
+                return -1;
+            const int kind = static_cast<Variable*>(a->d_lhs->d_resolved)->d_kind;
+            if( kind != Variable::InstanceLevel && kind != Variable::ClassLevel )
+                return -1;
+            const int cost = inlineCost( a->d_rhs.data() );
+            return cost < 0 ? -1 : cost + 1;
+        }
+    case Thing::T_MsgSend:
+        {
+            // the flow controls with blocks are excluded by T_Block
+            MsgSend* s = static_cast<MsgSend*>(e);
+            int cost = inlineCost( s->d_receiver.data() );
+            for( int i = 0; i < s->d_args.size() && cost >= 0; i++ )
+            {
+                const int c = inlineCost( s->d_args[i].data() );
+                cost = c < 0 ? -1 : cost + c;
+            }
+            return cost < 0 ? -1 : cost + 1;
+        }
+    default:
+        return -1;
+    }
+}
+
+static bool isSmallMethod( Method* m )
+{
+    enum { Budget = 8 }; // number of AST nodes
+    if( m == 0 || m->d_primitive || m->d_vars.size() != m->getParamCount() || m->d_body.size() > 1 )
+        return false;
+    if( m->d_body.isEmpty() )
+        return true;
+    Expression* e = m->d_body.first().data();
+    if( e->getTag() == Thing::T_Return )
+        e = static_cast<Return*>(e)->d_what.data();
+    const int cost = inlineCost(e);
+    return cost >= 0 && cost <= Budget;
+}
+
+bool LjObjectManager::isOverridden(Class* cls, const QByteArray& name, bool classLevel) const
+{
+    for( int i = 0; i < cls->d_subs.size(); i++ )
+    {
+        Class* sub = cls->d_subs[i].data();
+        const QList<Named*> methods = sub->d_methodNames.value(name.constData());
+        for( int j = 0; j < methods.size(); j++ )
+        {
+            if( static_cast<Method*>(methods[j])->d_classLevel == classLevel )
+                return true;
+        }
+        if( isOverridden( sub, name, classLevel ) )
+            return true;
+    }
+    if( !classLevel )
+    {
+        // metaclass objects find the instance methods of Object, Class and Metaclass after the class methods
+        Class* meta = d_classes.value( Lexer::getSymbol("Metaclass").constData() ).data();
+        for( Class* c = meta; c != 0; c = c->getSuper() )
+        {
+            if( c != cls )
+                continue;
+            for( Classes::const_iterator i = d_classes.begin(); i != d_classes.end(); ++i )
+            {
+                if( findMethod( i.value().data(), name, true ) )
+                    return true;
+            }
+            break;
+        }
+    }
+    return false;
+}
+
+void LjObjectManager::bindSends(Class* cls, LjbcCompiler2::Module& mod, const QList<Method*>& customized)
+{
+    // Class hierarchy analysis: all classes reachable so far are known, so the method called by a send to self is
+    // known if no subclass overrides it, and the one of a send to a class literal is known anyway; such sends
+    // call the method via a module upvalue instead of looking it up in the receiver. Sends to small methods are
+    // replaced by the method body, which is guarded if the method is the only implementation of an unknown receiver.
+    const bool inlining = d_options & LjbcCompiler2::InlineMethods;
+    QSet<QByteArray>& selfBound = d_selfBound[cls];
+    selfBound.clear();
+    QSet<Class*>& targets = d_targets[cls];
+    targets.clear();
+    const int order = d_loadingOrder.indexOf(cls);
+    Class* meta = d_classes.value( Lexer::getSymbol("Metaclass").constData() ).data();
+
+    FindSends v;
+    for( int i = 0; i < cls->d_methods.size(); i++ )
+    {
+        if( !cls->d_methods[i]->d_primitive )
+            cls->d_methods[i]->accept(&v);
+    }
+    for( int i = 0; i < customized.size(); i++ )
+        customized[i]->accept(&v); // self is an instance of this class or a subclass as well
+    for( int i = 0; i < v.sends.size(); i++ )
+    {
+        MsgSend* s = v.sends[i];
+        Ident* id = s->d_receiver->getTag() == Thing::T_Ident ? static_cast<Ident*>( s->d_receiver.data() ) : 0;
+        const QByteArray name = Lexer::getSymbol( s->prettyName(false) );
+        const QByteArray mapped = LuaTranspiler::map(name,s->d_patternType);
+        if( id && id->d_keyword == Expression::_self )
+        {
+            const bool classLevel = s->d_inMethod->d_classLevel;
+            if( classLevel && cls->d_name.constData() == _Object.constData() )
+                continue; // the Object metaclass has the methods of Class which its subclasses don't have
+            Method* m = findMethod( cls, name, classLevel );
+            if( m == 0 && classLevel )
+                m = findMethod( meta, name, false );
+            if( m == 0 )
+                continue; // not understood, leave it to the runtime
+            if( isOverridden( cls, name, classLevel ) )
+                continue;
+            if( classLevel )
+            {
+                mod.d_bound[s] = QByteArrayList() << cls->d_name << mapped;
+                selfBound << "^" + name;
+            }else
+            {
+                mod.d_bound[s] = QByteArrayList() << cls->d_name << "_class" << mapped;
+                selfBound << name;
+            }
+            if( inlining && isSmallMethod(m) )
+                mod.d_inlines[s].d_callee = m;
+        }else if( id && id->d_resolved && id->d_resolved->getTag() == Thing::T_Class )
+        {
+            // the class must already be compiled when the module constants are loaded
+            Class* target = static_cast<Class*>( id->d_resolved );
+            if( target != cls && ( d_loadingOrder.indexOf(target) < 0 || d_loadingOrder.indexOf(target) > order ) )
+                continue;
+            Method* m = findMethod( target, name, true );
+            if( m == 0 )
+                m = findMethod( meta, name, false );
+            if( m == 0 )
+                continue;
+            mod.d_bound[s] = QByteArrayList() << target->d_name << mapped;
+            if( target != cls )
+                targets << target;
+            if( inlining && isSmallMethod(m) )
+            {
+                mod.d_inlines[s].d_callee = m;
+                if( m->d_owner != cls )
+                    targets << static_cast<Class*>(m->d_owner);
+            }
+        }else if( inlining )
+        {
+            // the receiver is unknown; inline the method if it has only one instance level implementation
+            Method* m = 0;
+            int count = 0;
+            for( Classes::const_iterator j = d_classes.begin(); j != d_classes.end() && count < 2; ++j )
+            {
+                const QList<Named*> methods = j.value()->d_methodNames.value(name.constData());
+                for( int k = 0; k < methods.size(); k++ )
+                {
+                    if( !static_cast<Method*>(methods[k])->d_classLevel )
+                    {
+                        m = static_cast<Method*>(methods[k]);
+                        count++;
+                    }
+                }
+            }
+            if( count != 1 || !isSmallMethod(m) )
+                continue;
+            Class* target = static_cast<Class*>(m->d_owner);
+            if( target != cls && ( d_loadingOrder.indexOf(target) < 0 || d_loadingOrder.indexOf(target) > order ) )
+                continue; // the guard cannot be loaded
+            LjbcCompiler2::Module::Inline& inl = mod.d_inlines[s];
+            inl.d_callee = m;
+            inl.d_guard << target->d_name << "_class" << mapped;
+            if( target != cls )
+                targets << target;
+        }
+    }
+}
+
+void LjObjectManager::bindSuperSends(Class* cls, LjbcCompiler2::Module& mod)
+{
+    // The method called by a send to super only depends on the class hierarchy, which doesn't change anymore
+    // once the superclass is loaded; the flattened method table of the superclass already contains it, so the
+    // send calls it via a module upvalue instead of looking up the superclass and the method on each call.
+    Class* super = cls->getSuper();
+    if( super == 0 )
+        return;
+    Class* meta = d_classes.value( Lexer::getSymbol("Metaclass").constData() ).data();
+
+    FindSends v;
+    for( int i = 0; i < cls->d_methods.size(); i++ )
+    {
+        if( !cls->d_methods[i]->d_primitive )
+            cls->d_methods[i]->accept(&v);
+    }
+    for( int i = 0; i < v.supers.size(); i++ )
+    {
+        MsgSend* s = v.supers[i];
+        const QByteArray name = Lexer::getSymbol( s->prettyName(false) );
+        const bool classLevel = s->d_inMethod->d_classLevel;
+        Method* m = findMethod( super, name, classLevel );
+        if( m == 0 && classLevel )
+            m = findMethod( meta, name, false );
+        if( m == 0 )
+            continue; // not understood, leave it to the runtime
+        const QByteArray mapped = LuaTranspiler::map(name,s->d_patternType);
+        if( classLevel )
+            mod.d_bound[s] = QByteArrayList() << super->d_name << mapped;
+        else
+            mod.d_bound[s] = QByteArrayList() << super->d_name << "_class" << mapped;
+    }
+}
+
+bool LjObjectManager::isBindable(Class* cls, const QByteArray& name) const
+{
+    return findMethod( cls, name, false ) != 0 && !isOverridden( cls, name, false );
+}
+
+QList<Method*> LjObjectManager::customizedMethods(Class* cls) const
+{
+    // Inherited instance methods with self sends which bindSends can bind in this class, but not in the superclass
+    // because the target is overridden there, are compiled again for this class (customization). The subclasses
+    // inherit the customized method, which is valid as long as none of them overrides a target; new subclasses which
+    // do invalidate the class, see invalidatedBy. The size of the code generated per class is limited.
+    enum { Budget = 256 }; // number of sends of the customized methods per class
+    QList<Method*> res;
+    Class* super = cls->getSuper();
+    if( super == 0 )
+        return res;
+    int budget = Budget;
+    for( Class* c = super; c != 0; c = c->getSuper() )
+    {
+        for( int i = 0; i < c->d_methods.size(); i++ )
+        {
+            Method* m = c->d_methods[i].data();
+            if( m->d_primitive || m->d_classLevel || findMethod( cls, m->d_name, false ) != m )
+                continue; // overridden in a class between c and cls
+            FindSends v;
+            m->accept(&v);
+            if( v.sends.size() > budget )
+                continue;
+            bool gain = false;
+            for( int j = 0; j < v.sends.size() && !gain; j++ )
+            {
+                MsgSend* s = v.sends[j];
+                if( s->d_receiver->keyword() != Expression::_self )
+                    continue;
+                const QByteArray name = Lexer::getSymbol( s->prettyName(false) );
+                gain = isBindable( cls, name ) && !isBindable( super, name );
+            }
+            if( gain )
+            {
+                res << m;
+                budget -= v.sends.size();
+            }
+        }
+    }
+    return res;
+}
+
+bool LjObjectManager::hasIntegerPrimitives() const
+{
+    // the code generated for values statically known to be Integers calls no methods, so Integer must have
+    // the primitives the inlined arithmetic and comparisons correspond to
+    Class* integer = d_classes.value( Lexer::getSymbol("Integer").constData() ).data();
+    if( integer == 0 )
+        return false;
+    static const char* prims[] = { "+", "-", "*", "%", "=", "<", 0 };
+    for( int i = 0; prims[i] != 0; i++ )
+    {
+        Method* m = findMethod( integer, Lexer::getSymbol(prims[i]), false );
+        if( m == 0 || !m->d_primitive || m->d_owner != integer )
+            return false;
+    }
+    Method* m = findMethod( integer, Lexer::getSymbol("=="), false );
+    return m != 0 && m->d_primitive && static_cast<Class*>(m->d_owner)->d_name.constData() == _Object.constData();
+}
+
+static bool understood( MsgSend* s, const QByteArray& sel, Class* meta )
+{
+    // whether the class of the receiver is known to implement the selector; otherwise the send can end up in
+    // doesNotUnderstand:arguments:, which gets the args in an Array and could keep them
+    if( s->d_receiver->getTag() != Thing::T_Ident || s->d_inMethod == 0 )
+        return false;
+    Ident* id = static_cast<Ident*>( s->d_receiver.data() );
+    Class* cls = static_cast<Class*>( s->d_inMethod->d_owner );
+    bool classLevel = s->d_inMethod->d_classLevel;
+    if( id->d_keyword == Expression::_super )
+        cls = cls->getSuper();
+    else if( id->d_resolved && id->d_resolved->getTag() == Thing::T_Class )
+    {
+        cls = static_cast<Class*>( id->d_resolved );
+        classLevel = true;
+    }else if( id->d_keyword != Expression::_self )
+        return false;
+    if( findMethod( cls, sel, classLevel ) )
+        return true;
+    return classLevel && findMethod( meta, sel, false );
+}
+
+struct FindEscapes
+{
+    // Checks whether a param of a method escapes, i.e. can be referenced after the method returns. The param
+    // doesn't escape if it is only the receiver of value sends or passed to args which don't escape either,
+    // also from blocks which themselves are passed to such args. All other uses, including the result of a block,
+    // are considered to let it escape.
+    Variable* param;
+    const QHash<QByteArray,quint32>& nonEscaping;
+    Class* meta;
+    const bool dnuKeeps;
+    FindEscapes(Variable* p, const QHash<QByteArray,quint32>& n, Class* m):param(p),nonEscaping(n),meta(m),
+        dnuKeeps(dnuKeepsArgs(n)){}
+
+    bool refersTo( Expression* e ) const
+    {
+        switch( e->getTag() )
+        {
+        case Thing::T_Ident:
+            return static_cast<Ident*>(e)->d_resolved == param;
+        case Thing::T_Assig:
+            return refersTo( static_cast<Assig*>(e)->d_rhs.data() );
+        case Thing::T_Return:
+            return refersTo( static_cast<Return*>(e)->d_what.data() );
+        case Thing::T_Array:
+            {
+                ArrayLiteral* a = static_cast<ArrayLiteral*>(e);
+                for( int i = 0; i < a->d_elements.size(); i++ )
+                    if( refersTo( a->d_elements[i].data() ) )
+                        return true;
+                return false;
+            }
+        case Thing::T_Block:
+            {
+                Block* b = static_cast<Block*>(e);
+                for( int i = 0; i < b->d_func->d_body.size(); i++ )
+                    if( refersTo( b->d_func->d_body[i].data() ) )
+                        return true;
+                return false;
+            }
+        case Thing::T_MsgSend:
+            {
+                MsgSend* s = static_cast<MsgSend*>(e);
+                if( refersTo( s->d_receiver.data() ) )
+                    return true;
+                for( int i = 0; i < s->d_args.size(); i++ )
+                    if( refersTo( s->d_args[i].data() ) )
+                        return true;
+                return false;
+            }
+        default:
+            return false;
+        }
+    }
+
+    bool escapes( Expression* e ) const
+    {
+        switch( e->getTag() )
+        {
+        case Thing::T_Ident:
+            return static_cast<Ident*>(e)->d_resolved == param;
+        case Thing::T_Assig:
+            return escapes( static_cast<Assig*>(e)->d_rhs.data() );
+        case Thing::T_Return:
+            return escapes( static_cast<Return*>(e)->d_what.data() );
+        case Thing::T_Array:
+            return refersTo(e);
+        case Thing::T_Block:
+            {
+                Block* b = static_cast<Block*>(e);
+                if( !b->d_func->d_inline )
+                    return refersTo(e); // the block itself escapes
+                return escapesIn(b);
+            }
+        case Thing::T_MsgSend:
+            {
+                MsgSend* s = static_cast<MsgSend*>(e);
+                const QByteArray sel = Lexer::getSymbol( s->prettyName(false) );
+                const bool invoked = sel == "value" || sel == "value:" || sel == "value:with:";
+                if( !( invoked && s->d_receiver->getTag() == Thing::T_Ident ) && escapes( s->d_receiver.data() ) )
+                    return true;
+                quint32 kept = ~nonEscaping.value(sel);
+                if( dnuKeeps && !understood( s, sel, meta ) )
+                    kept = 0xffffffff;
+                for( int i = 0; i < s->d_args.size(); i++ )
+                {
+                    Expression* arg = s->d_args[i].data();
+                    if( kept & ( 1 << i ) )
+                    {
+                        if( escapes(arg) )
+                            return true;
+                    }else if( arg->getTag() == Thing::T_Block )
+                    {
+                        if( escapesIn( static_cast<Block*>(arg) ) )
+                            return true;
+                    }else if( arg->getTag() != Thing::T_Ident && escapes(arg) )
+                        return true;
+                }
+                return false;
+            }
+        default:
+            return false;
+        }
+    }
+
+    bool escapesIn( Block* b ) const
+    {
+        for( int i = 0; i < b->d_func->d_body.size(); i++ )
+            if( escapes( b->d_func->d_body[i].data() ) )
+                return true;
+        return false;
+    }
+};
+
+QHash<QByteArray,quint32> LjObjectManager::nonEscapingArgs() const
+{
+    // A block passed as an argument can only be reused if no implementation of the selector keeps it beyond the
+    // call (the receiver is unknown, but all classes are). Starting with all args not escaping, the args of the
+    // implementations which don't satisfy FindEscapes with the current assumptions are removed until nothing changes.
+    // Primitives keep their args, except for the ones which just evaluate blocks.
+    // If doesNotUnderstand:arguments: can keep its args, only the sends known to be understood are considered.
+    QHash<QByteArray,quint32> res;
+    Class* meta = d_classes.value( Lexer::getSymbol("Metaclass").constData() ).data();
+    QList<Method*> methods;
+    for( Classes::const_iterator i = d_classes.begin(); i != d_classes.end(); ++i )
+    {
+        Class* cls = i.value().data();
+        for( int j = 0; j < cls->d_methods.size(); j++ )
+        {
+            Method* m = cls->d_methods[j].data();
+            const int n = m->getParamCount();
+            if( n == 0 || n > 32 )
+                continue;
+            res[m->d_name] = n == 32 ? 0xffffffff : ( 1 << n ) - 1;
+            methods << m;
+        }
+    }
+    bool changed = true;
+    while( changed )
+    {
+        changed = false;
+        for( int i = 0; i < methods.size(); i++ )
+        {
+            Method* m = methods[i];
+            const quint32 old = res.value(m->d_name);
+            quint32 mask = old;
+            for( int j = 0; j < m->getParamCount() && mask != 0; j++ )
+            {
+                if( !( mask & ( 1 << j ) ) )
+                    continue;
+                bool keeps = false;
+                if( m->d_primitive )
+                {
+                    const QByteArray cls = static_cast<Class*>(m->d_owner)->d_name;
+                    keeps = !( ( cls == "Block" && m->d_name == "whileTrue:" ) ||
+                            ( cls == "Boolean" && ( m->d_name == "ifTrue:" || m->d_name == "ifFalse:" ||
+                                                    m->d_name == "and:" || m->d_name == "or:" ) ) );
+                }else
+                {
+                    FindEscapes f( m->d_vars[j].data(), res, meta );
+                    for( int k = 0; k < m->d_body.size() && !keeps; k++ )
+                        keeps = f.escapes( m->d_body[k].data() );
+                }
+                if( keeps )
+                    mask &= ~( 1 << j );
+            }
+            if( mask != old )
+            {
+                res[m->d_name] = mask;
+                changed = true;
+            }
+        }
+    }
+    QHash<QByteArray,quint32>::iterator i = res.begin();
+    while( i != res.end() )
+    {
+        if( i.value() == 0 )
+            i = res.erase(i);
+        else
+            ++i;
+    }
+    return res;
+}
+
+void LjObjectManager::findReusedBlocks(Class* cls, LjbcCompiler2::Module& mod)
+{
+    // the non-inlined block literals passed to args which don't escape; shared blocks have an instance anyway
+    FindSends v;
+    for( int i = 0; i < cls->d_methods.size(); i++ )
+    {
+        if( !cls->d_methods[i]->d_primitive )
+            cls->d_methods[i]->accept(&v);
+    }
+    Class* meta = d_classes.value( Lexer::getSymbol("Metaclass").constData() ).data();
+    const bool dnuKeeps = dnuKeepsArgs(d_nonEscaping);
+    const QList<MsgSend*> sends = v.sends + v.supers;
+    for( int i = 0; i < sends.size(); i++ )
+    {
+        MsgSend* s = sends[i];
+        const QByteArray sel = Lexer::getSymbol( s->prettyName(false) );
+        if( dnuKeeps && !understood( s, sel, meta ) )
+            continue;
+        const quint32 mask = d_nonEscaping.value( sel );
+        for( int j = 0; j < s->d_args.size() && j < 32; j++ )
+        {
+            if( !( mask & ( 1 << j ) ) || s->d_args[j]->getTag() != Thing::T_Block )
+                continue;
+            Block* b = static_cast<Block*>( s->d_args[j].data() );
+            if( !b->d_func->d_inline && !cls->d_relocated.contains(b->d_func.data()) )
+                mod.d_reused << b;
+        }
+    }
+}
+
+static bool isCallback( Method* m )
+{
+    // the primitives which call blocks or methods, see SomPrimitives.lua
+    Q_ASSERT( m->d_primitive );
+    const QByteArray cls = static_cast<Class*>(m->d_owner)->d_name;
+    if( cls.startsWith("Block") )
+        return true;
+    if( cls == "Boolean" )
+        return m->d_name == "ifTrue:" || m->d_name == "ifFalse:" || m->d_name == "and:" || m->d_name == "or:";
+    return m->d_name.startsWith("perform:") || m->d_name == "invokeOn:with:";
+}
+
+QSet<QByteArray> LjObjectManager::nonLocalReturnSelectors() const
+{
+    // A non-local return passes from the block up through all frames to the home method; so a send can only
+    // see one if some implementation of its selector calls a block (i.e. is a primitive callback) or does a send
+    // which can see one; the sends in (non-inlined) blocks are covered by the primitives calling the blocks.
+    QSet<QByteArray> res;
+    QHash<Method*,QSet<QByteArray> > sent;
+    bool nonLocalReturn = false;
+    for( Classes::const_iterator i = d_classes.begin(); i != d_classes.end(); ++i )
+    {
+        Class* cls = i.value().data();
+        for( int j = 0; j < cls->d_methods.size(); j++ )
+        {
+            Method* m = cls->d_methods[j].data();
+            if( m->d_primitive )
+            {
+                if( isCallback(m) )
+                    res << m->d_name;
+                continue;
+            }
+            FindSends v;
+            m->accept(&v);
+            nonLocalReturn = nonLocalReturn || v.nonLocalReturn;
+            v.selectors.clear();
+            v.intoBlocks = false;
+            m->accept(&v);
+            sent[m] = v.selectors;
+        }
+    }
+    if( !nonLocalReturn )
+        return QSet<QByteArray>(); // no sends can see a non-local return
+    bool changed = true;
+    while( changed )
+    {
+        changed = false;
+        QHash<Method*,QSet<QByteArray> >::const_iterator i;
+        for( i = sent.begin(); i != sent.end(); ++i )
+        {
+            if( !res.contains(i.key()->d_name) && i.value().intersects(res) )
+            {
+                res << i.key()->d_name;
+                changed = true;
+            }
+        }
+    }
+    return res;
+}
+
+QList<Class*> LjObjectManager::invalidatedBy(int firstNew, const QSet<QByteArray>& nlrSelectors ) const
+{
+    // the old classes with bound self sends to methods overridden by the new classes, and their subclasses;
+    // also the ones which compiled sends of the given selectors with assumptions which no longer hold, and
+    // the ones which bind or inline methods of any of these
+    QSet<Class*> invalid;
+    for( int i = 0; i < firstNew && !nlrSelectors.isEmpty(); i++ )
+    {
+        Class* cls = d_loadingOrder[i];
+        FindSends v;
+        for( int j = 0; j < cls->d_methods.size(); j++ )
+            cls->d_methods[j]->accept(&v);
+        if( v.selectors.intersects(nlrSelectors) )
+            invalid << cls;
+    }
+    for( int i = firstNew; i < d_loadingOrder.size(); i++ )
+    {
+        Class* cls = d_loadingOrder[i];
+        for( int j = 0; j < cls->d_methods.size(); j++ )
+        {
+            Method* m = cls->d_methods[j].data();
+            const QByteArray key = m->d_classLevel ? "^" + m->d_name : m->d_name;
+            for( Class* super = cls->getSuper(); super != 0; super = super->getSuper() )
+            {
+                if( d_selfBound.value(super).contains(key) )
+                    invalid << super;
+            }
+            if( m->d_classLevel )
+            {
+                // see isOverridden
+                Class* meta = d_classes.value( Lexer::getSymbol("Metaclass").constData() ).data();
+                for( Class* c = meta; c != 0; c = c->getSuper() )
+                {
+                    if( d_selfBound.value(c).contains(m->d_name) )
+                        invalid << c;
+                }
+            }
+        }
+    }
+    QList<Class*> res;
+    QSet<Class*> done;
+    bool changed = true;
+    while( changed )
+    {
+        // the classes which bind or inline methods of a recompiled class refer to its old code, so they are
+        // recompiled as well, and so on
+        changed = false;
+        for( int i = 0; i < firstNew; i++ )
+        {
+            Class* cls = d_loadingOrder[i];
+            if( done.contains(cls) )
+                continue;
+            bool inval = d_targets.value(cls).intersects(done);
+            for( Class* c = cls; c != 0 && !inval; c = c->getSuper() )
+                inval = invalid.contains(c) || done.contains(c); // subclasses copied the methods of the invalid class
+            if( inval )
+            {
+                done << cls;
+                changed = true;
+            }
+        }
+    }
+    for( int i = 0; i < firstNew; i++ )
+    {
+        if( done.contains(d_loadingOrder[i]) )
+            res << d_loadingOrder[i];
+    }
+    return res;
+}
+
+static const quint32 s_cacheVersion = 4; // increment whenever this format changes, see generatorId for the code
+static const char* s_primitivesPath = ":/SomPrimitives.lua";
+
+static QByteArray generatorId()
+{
+    // the cached and bundled code is only valid for the build of the code generators which produced it and the
+    // primitives it calls; the build stamps change with every build of these files, and so does the identity
+    static QByteArray id;
+    if( id.isEmpty() )
+    {
+        QCryptographicHash h( QCryptographicHash::Sha1 );
+        h.addData( QByteArray::number(s_cacheVersion) );
+        h.addData( __DATE__ " " __TIME__ );
+        h.addData( LjbcCompiler2::buildStamp() );
+        h.addData( LjbcCompiler::buildStamp() );
+        h.addData( LuaTranspiler::buildStamp() );
+        h.addData( LjbcPeephole::buildStamp() );
+        QFile in(s_primitivesPath);
+        if( in.open(QIODevice::ReadOnly) )
+            h.addData( in.readAll() );
+        id = h.result().toHex();
+    }
+    return id;
+}
+
+namespace Som
+{
+QDataStream& operator<<( QDataStream& out, const LjObjectManager::ClassImage& cls )
+{
+    return out << cls.d_name << cls.d_superName << cls.d_source << cls.d_fields << cls.d_classFields
+               << cls.d_methods << cls.d_inherited << cls.d_classInherited << cls.d_primitives
+               << cls.d_selfBound << cls.d_targets << cls.d_code;
+}
+
+QDataStream& operator>>( QDataStream& in, LjObjectManager::ClassImage& cls )
+{
+    return in >> cls.d_name >> cls.d_superName >> cls.d_source >> cls.d_fields >> cls.d_classFields
+               >> cls.d_methods >> cls.d_inherited >> cls.d_classInherited >> cls.d_primitives
+               >> cls.d_selfBound >> cls.d_targets >> cls.d_code;
+}
+}
+
+static QByteArray hashOfFile( const QString& path )
+{
+    QFile in(path);
+    if( !in.open(QIODevice::ReadOnly) )
+        return QByteArray();
+    return QCryptographicHash::hash( in.readAll(), QCryptographicHash::Sha1 );
+}
+
+QByteArray LjObjectManager::cacheKey() const
+{
+    // the generated code depends on the whole program, so there is one entry per program and not per class
+    QByteArray res;
+    QTextStream out(&res);
+    out << generatorId() << " " << ( d_genLua ? "lua" : d_genClosures ? "clo" : "bc" ) << " " << d_options << endl;
+    out << QFileInfo(d_mainPath).absoluteFilePath() << endl;
+    out << d_classPaths.join(':') << endl;
+    out.flush();
+    return res;
+}
+
+static QString cacheFileName( const QString& dir, const QByteArray& key )
+{
+    return QDir(dir).absoluteFilePath(
+                QCryptographicHash::hash( key, QCryptographicHash::Sha1 ).toHex() + ".ljc" );
+}
+
+bool LjObjectManager::loadFromCache()
+{
+    // a hit skips lexing, parsing, resolving and code generation of all classes; the entry is only used
+    // if each class would still be loaded from the same file with the same content
+    if( d_cacheDir.isEmpty() )
+        return false;
+    const QByteArray key = cacheKey();
+    QFile in( cacheFileName( d_cacheDir, key ) );
+    if( !in.open(QIODevice::ReadOnly) )
+        return false;
+    QDataStream s(&in);
+    s.setVersion(QDataStream::Qt_5_0);
+    quint32 version;
+    QByteArray k, mainName, runSelector;
+    quint32 count;
+    s >> version >> k >> mainName >> count;
+    if( s.status() != QDataStream::Ok || version != s_cacheVersion || k != key )
+        return false;
+    for( quint32 i = 0; i < count; i++ )
+    {
+        QByteArray name, hash;
+        QString path;
+        s >> name >> path >> hash;
+        if( s.status() != QDataStream::Ok )
+            return false;
+        if( name != mainName && findClassFile( name.constData() ) != path )
+            return false; // a new class file hides the one used
+        if( hashOfFile( path ) != hash )
+            return false;
+    }
+    QList<ClassImage> images;
+    s >> runSelector >> images;
+    if( s.status() != QDataStream::Ok || images.isEmpty() )
+        return false;
+
+    d_mainName = mainName;
+    d_runSelector = runSelector;
+    d_images = images;
+    installImages();
+    return true;
+}
+
+bool LjObjectManager::installImages()
+{
+    const int top = lua_gettop(d_lua->getCtx());
+    for( int i = 0; i < d_images.size(); i++ )
+    {
+        instantiateClass( d_images[i] );
+        if( d_images[i].d_name == _Class )
+            connectObjectMeta( d_images[i] );
+    }
+    connectValueTypes();
+    for( int i = 0; i < d_images.size(); i++ )
+        installClass( d_images[i] );
+    Q_ASSERT( top == lua_gettop(d_lua->getCtx()) );
+    return d_errors.isEmpty();
+}
+
+bool LjObjectManager::restoreAsts()
+{
+    // the classes were loaded from the cache, but a class loaded at runtime is compiled against the others
+    // and can invalidate them; parse them again and restore the state their cached code was compiled with
+    if( !loadClasses() )
+        return false;
+    if( d_loadingOrder.size() != d_images.size() )
+        return error( tr("the class files have changed since they were loaded from the cache") );
+    for( int i = 0; i < d_loadingOrder.size(); i++ )
+    {
+        Class* cls = d_loadingOrder[i];
+        if( cls->d_name != d_images[i].d_name )
+            return error( tr("the class files have changed since they were loaded from the cache") );
+        assignNlrTokens(cls);
+        d_selfBound[cls] = d_images[i].d_selfBound.toSet();
+        QSet<Class*>& targets = d_targets[cls];
+        for( int j = 0; j < d_images[i].d_targets.size(); j++ )
+        {
+            Class* target = d_classes.value( Lexer::getSymbol(d_images[i].d_targets[j]).constData() ).data();
+            if( target )
+                targets << target;
+        }
+    }
+    d_instantiated = d_loadingOrder.size();
+    d_nlrSelectors = nonLocalReturnSelectors();
+    d_nonEscaping = nonEscapingArgs();
+    return true;
+}
+
+void LjObjectManager::saveToCache()
+{
+    if( d_cacheDir.isEmpty() )
+        return;
+    QDir().mkpath(d_cacheDir);
+    // concurrent runs see either the old or the new entry, but never a partial one
+    QSaveFile out( cacheFileName( d_cacheDir, cacheKey() ) );
+    if( !out.open(QIODevice::WriteOnly) )
+    {
+        qWarning() << "cannot write cache entry" << out.fileName();
+        return;
+    }
+    QDataStream s(&out);
+    s.setVersion(QDataStream::Qt_5_0);
+    s << s_cacheVersion << cacheKey() << d_mainName << quint32(d_loadingOrder.size());
+    for( int i = 0; i < d_loadingOrder.size(); i++ )
+    {
+        Class* cls = d_loadingOrder[i];
+        s << cls->d_name << cls->d_loc.d_source << hashOfFile( cls->d_loc.d_source );
+    }
+    s << d_runSelector << d_images;
+    if( !out.commit() )
+        qWarning() << "cannot write cache entry" << out.fileName();
+}
+
+static int writeChunk( lua_State*, const void* p, size_t sz, void* ud )
+{
+    static_cast<QByteArray*>(ud)->append( static_cast<const char*>(p), sz );
+    return 0;
+}
+
+bool LjObjectManager::toBytecode(const QByteArray& code, const QByteArray& name, QByteArray& out)
+{
+    static const char s_sig[] = "\x1bLJ";
+    if( code.startsWith(s_sig) )
+    {
+        out = code;
+        return true;
+    }
+    lua_State* L = d_lua->getCtx();
+    if( luaL_loadbuffer( L, code.constData(), code.size(), name.constData() ) != 0 )
+    {
+        error( lua_tostring(L, -1) );
+        lua_pop( L, 1 );
+        return false;
+    }
+    out.clear();
+    lua_dump( L, writeChunk, &out );
+    lua_pop( L, 1 );
+    return true;
+}
+
+bool LjObjectManager::saveBundle(const QString& path, bool withState)
+{
+    // everything needed to run the loaded program without the front end and the SOM sources
+    if( d_images.isEmpty() )
+        return error( tr("no program loaded") );
+    QFile in(s_primitivesPath);
+    if( !in.open(QIODevice::ReadOnly) )
+        return error( tr("cannot open for reading '%1'").arg(s_primitivesPath) );
+    QByteArray primitives;
+    if( !toBytecode( in.readAll(), "=SomPrimitives.lua", primitives ) )
+        return false;
+    QList<ClassImage> images = d_images;
+    for( int i = 0; i < images.size(); i++ )
+    {
+        if( !toBytecode( d_images[i].d_code, "=" + d_images[i].d_name + ".lua", images[i].d_code ) )
+            return false;
+    }
+
+    QSaveFile out(path);
+    if( !out.open(QIODevice::WriteOnly) )
+        return error( tr("cannot open file for writing '%1'").arg(path) );
+    QDataStream s(&out);
+    s.setVersion(QDataStream::Qt_5_0);
+    // manifest
+    s << QByteArray("LjSOM bundle") << s_cacheVersion << generatorId()
+      << QByteArray( d_genLua ? "lua" : d_genClosures ? "clo" : "bc" )
+      << d_options << QFileInfo(d_mainPath).fileName() << d_mainName << d_runSelector << getClassNames();
+    s << primitives << images;
+    s << withState;
+    if( withState && !snapshot(s,true) )
+        return false; // the file is not committed
+    if( !out.commit() )
+        return error( tr("cannot write file '%1'").arg(path) );
+    return true;
+}
+
+bool LjObjectManager::loadBundle(const QString& path)
+{
+    d_errors.clear();
+    d_mainClass.reset();
+    d_classes.clear();
+    d_loadingOrder.clear();
+    d_images.clear();
+    d_classPaths.clear(); // classes loaded at runtime can't be found without the sources
+    d_selfBound.clear();
+    d_targets.clear();
+    d_nlrSelectors.clear();
+    d_nonEscaping.clear();
+    d_nlrTokens = 0;
+    d_instantiated = 0;
+    d_generated.clear();
+
+    QFile in(path);
+    if( !in.open(QIODevice::ReadOnly) )
+        return error( tr("cannot open file for reading '%1'").arg(path) );
+    QDataStream s(&in);
+    s.setVersion(QDataStream::Qt_5_0);
+    QByteArray magic, generator, mode, primitives;
+    quint32 version, options;
+    QString mainFile;
+    QByteArrayList classNames;
+    s >> magic >> version;
+    if( s.status() != QDataStream::Ok || magic != "LjSOM bundle" )
+        return error( tr("not a bundle '%1'").arg(path) );
+    if( version != s_cacheVersion )
+        return error( tr("bundle '%1' was built by another version").arg(path) );
+    s >> generator;
+    if( generator != generatorId() )
+        return error( tr("bundle '%1' was built by another version").arg(path) );
+    s >> mode >> options >> mainFile >> d_mainName >> d_runSelector >> classNames;
+    if( s.status() == QDataStream::Ok &&
+            ( mode != ( d_genLua ? "lua" : d_genClosures ? "clo" : "bc" ) || options != d_options ) )
+        return error( tr("bundle '%1' was built with other code generation options").arg(path) );
+    bool withState;
+    s >> primitives >> d_images >> withState;
+    if( s.status() != QDataStream::Ok || d_images.size() != classNames.size() )
+        return error( tr("bundle '%1' is corrupt").arg(path) );
+    d_mainPath = QFileInfo(path).absoluteDir().absoluteFilePath(mainFile);
+
+    if( !d_lua->addSourceLib( primitives, "SomPrimitives" ) )
+        return error( d_lua->getLastError() );
+    if( !installImages() || !defineRunSom() )
+        return false;
+    if( withState && !snapshot(s,false) )
+        return error( tr("bundle '%1' is corrupt").arg(path) );
+    return true;
+}
+
+bool LjObjectManager::warmUp(const QByteArray& selector)
+{
+    // runs a unary method of the main class like run, e.g. to build tables before a snapshot
+    if( !d_lua->executeCmd( d_mainName + "._class:" + LuaTranspiler::map(selector) + "()" ) )
+        return error( d_lua->getLastError() );
+    return true;
+}
+
+// The state of a program which survives the return of a method is reachable from the class fields and the
+// globals; it is written as a graph of values. Classes, metaclasses and system are referenced by name, since
+// they are recreated from the images, as are the metatables of nil, numbers, booleans and Doubles.
+enum StateTag { StNil, StFalse, StTrue, StNumber, StDouble, StString, StSymbol, StClass, StMeta, StSystem,
+                StRef, StTable };
+
+struct SnapshotArgs
+{
+    LjObjectManager* om;
+    QDataStream* stream;
+    bool write;
+    bool ok;
+};
+
+int LjObjectManager::snapshotImp(lua_State* L)
+{
+    SnapshotArgs* a = static_cast<SnapshotArgs*>( lua_touserdata(L,1) );
+    a->ok = a->write ? a->om->writeState(*a->stream) : a->om->readState(*a->stream);
+    return 0;
+}
+
+bool LjObjectManager::snapshot(QDataStream& s, bool write)
+{
+    // writeValue and readValue recurse along the object graph; a graph too deep for the Lua stack, or any other
+    // Lua error on the way, fails the snapshot instead of ending in a panic
+    lua_State* L = d_lua->getCtx();
+    SnapshotArgs a = { this, &s, write, false };
+    if( lua_cpcall( L, snapshotImp, &a ) != 0 )
+    {
+        const QString msg = lua_tostring(L,-1);
+        lua_pop(L,1);
+        return error( tr("cannot %1 snapshot: %2").arg( write ? "write" : "read" ).arg(msg) );
+    }
+    return a.ok;
+}
+
+bool LjObjectManager::writeState(QDataStream& out)
+{
+    lua_State* L = d_lua->getCtx();
+    const int top = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int refs = lua_gettop(L); // table -> id
+    quint32 count = 0;
+    bool ok = true;
+    for( int i = 0; i < d_images.size() && ok; i++ )
+    {
+        lua_getglobal( L, d_images[i].d_name.constData() );
+        const int metaT = lua_gettop(L);
+        for( int j = 0; j < d_images[i].d_classFields.size() && ok; j++ )
+        {
+            lua_rawgeti( L, metaT, j + 1 );
+            ok = writeValue( out, refs, lua_gettop(L), count );
+            lua_pop(L,1);
+            if( !ok )
+                error( tr("cannot snapshot class field %1.%2").arg(d_images[i].d_name.constData())
+                       .arg(d_images[i].d_classFields[j].constData()) );
+        }
+        lua_pop(L,1); // metaT
+    }
+
+    // runSom and warmUp use the class table of the main class as the instance
+    const int mainIndex = getClassNames().indexOf(d_mainName);
+    Q_ASSERT( mainIndex >= 0 );
+    lua_getglobal( L, d_mainName.constData() );
+    lua_getfield( L, -1, "_class" );
+    const int mainT = lua_gettop(L);
+    for( int j = 0; j < d_images[mainIndex].d_fields.size() && ok; j++ )
+    {
+        lua_rawgeti( L, mainT, j + 1 );
+        ok = writeValue( out, refs, lua_gettop(L), count );
+        lua_pop(L,1);
+        if( !ok )
+            error( tr("cannot snapshot field %1").arg(d_images[mainIndex].d_fields[j].constData()) );
+    }
+    lua_pop(L,2); // metaT, mainT
+
+    // the globals set by the program, e.g. with system global:put:; the ones of the runtime were there
+    // when defineRunSom finished, and the names starting with _ are used by the generated code
+    QSet<QByteArray> skip = getClassNames().toSet();
+    skip.unite( d_runtimeGlobals );
+    skip << "system" << "somArgs";
+    lua_pushvalue( L, LUA_GLOBALSINDEX );
+    const int globals = lua_gettop(L);
+    lua_pushnil(L);
+    while( ok && lua_next( L, globals ) != 0 )
+    {
+        if( lua_type(L,-2) == LUA_TSTRING )
+        {
+            const QByteArray name = lua_tostring(L,-2);
+            if( !name.startsWith('_') && !skip.contains(name) )
+            {
+                out << name;
+                ok = writeValue( out, refs, lua_gettop(L), count );
+                if( !ok )
+                    error( tr("cannot snapshot global %1").arg(name.constData()) );
+            }
+        }
+        lua_pop(L,1);
+    }
+    out << QByteArray();
+
+    lua_settop(L,top);
+    return ok;
+}
+
+bool LjObjectManager::writeValue(QDataStream& out, int refs, int v, quint32& count)
+{
+    lua_State* L = d_lua->getCtx();
+    luaL_checkstack( L, 8, "snapshot too deep" );
+    switch( lua_type(L,v) )
+    {
+    case LUA_TNIL:
+        out << quint8(StNil);
+        return true;
+    case LUA_TBOOLEAN:
+        out << quint8( lua_toboolean(L,v) ? StTrue : StFalse );
+        return true;
+    case LUA_TNUMBER:
+        out << quint8(StNumber) << double(lua_tonumber(L,v));
+        return true;
+    case LUA_TSTRING:
+        {
+            size_t len;
+            const char* str = lua_tolstring(L,v,&len);
+            out << quint8(StString) << QByteArray(str,len);
+        }
+        return true;
+    case LUA_TTABLE:
+        break;
+    default:
+        if( qstrcmp( lua_typename( L, lua_type(L,v) ), "cdata" ) == 0 )
+        {
+            // Doubles are the only cdata values of SOM
+            lua_getfield( L, v, "_dbl" );
+            out << quint8(StDouble) << double(lua_tonumber(L,-1));
+            lua_pop(L,1);
+            return true;
+        }
+        return false; // functions, i.e. blocks and methods, userdata and coroutines
+    }
+
+    lua_pushvalue(L,v);
+    lua_rawget(L,refs);
+    if( !lua_isnil(L,-1) )
+    {
+        out << quint8(StRef) << quint32(lua_tointeger(L,-1));
+        lua_pop(L,1);
+        return true;
+    }
+    lua_pop(L,1);
+
+    lua_getglobal(L,"system");
+    const bool system = lua_rawequal(L,-1,v);
+    lua_pop(L,1);
+    if( system )
+    {
+        out << quint8(StSystem);
+        return true;
+    }
+
+    lua_pushstring(L,"_name");
+    lua_rawget(L,v);
+    if( lua_isstring(L,-1) )
+    {
+        // a class table; the metaclass is a global, the class is its _class field
+        QByteArray name = lua_tostring(L,-1);
+        if( name.endsWith(" class") )
+            name.chop(6);
+        lua_getglobal( L, name.constData() );
+        const bool isMeta = lua_rawequal(L,-1,v);
+        lua_getfield( L, -1, "_class" );
+        const bool isClass = lua_rawequal(L,-1,v);
+        lua_pop(L,3);
+        if( isMeta || isClass )
+        {
+            out << quint8( isMeta ? StMeta : StClass ) << name;
+            return true;
+        }
+    }else
+        lua_pop(L,1);
+
+    QByteArray cls;
+    if( lua_getmetatable(L,v) )
+    {
+        lua_getfield( L, -1, "_name" );
+        cls = lua_tostring(L,-1);
+        lua_pop(L,1);
+        lua_getglobal( L, cls.constData() );
+        const bool known = !cls.isEmpty() && lua_istable(L,-1);
+        if( known )
+            lua_getfield( L, -1, "_class" );
+        else
+            lua_pushnil(L);
+        const bool isInstance = known && lua_rawequal(L,-1,-3);
+        lua_pop(L,3);
+        if( !isInstance )
+            return false;
+        if( cls == "Symbol" )
+        {
+            // Symbols are interned
+            lua_getfield( L, v, "_str" );
+            out << quint8(StSymbol) << QByteArray(lua_tostring(L,-1));
+            lua_pop(L,1);
+            return true;
+        }
+    }
+
+    lua_pushvalue(L,v);
+    lua_pushinteger(L,++count);
+    lua_rawset(L,refs);
+    out << quint8(StTable) << count << cls;
+    lua_pushnil(L);
+    while( lua_next( L, v ) != 0 )
+    {
+        const int top = lua_gettop(L);
+        if( !writeValue( out, refs, top - 1, count ) || !writeValue( out, refs, top, count ) )
+        {
+            lua_pop(L,2);
+            return false;
+        }
+        lua_pop(L,1);
+    }
+    out << quint8(StNil); // no key is nil
+    return true;
+}
+
+bool LjObjectManager::readState(QDataStream& in)
+{
+    lua_State* L = d_lua->getCtx();
+    const int top = lua_gettop(L);
+    lua_createtable(L,0,0);
+    const int refs = lua_gettop(L); // id -> table
+    bool ok = true;
+    for( int i = 0; i < d_images.size() && ok; i++ )
+    {
+        lua_getglobal( L, d_images[i].d_name.constData() );
+        const int metaT = lua_gettop(L);
+        for( int j = 0; j < d_images[i].d_classFields.size() && ok; j++ )
+        {
+            ok = readValue( in, refs );
+            if( ok )
+                lua_rawseti( L, metaT, j + 1 );
+        }
+        lua_pop(L,1); // metaT
+    }
+    const int mainIndex = getClassNames().indexOf(d_mainName);
+    ok = ok && mainIndex >= 0;
+    lua_getglobal( L, d_mainName.constData() );
+    lua_getfield( L, -1, "_class" );
+    const int mainT = lua_gettop(L);
+    for( int j = 0; ok && j < d_images[mainIndex].d_fields.size(); j++ )
+    {
+        ok = readValue( in, refs );
+        if( ok )
+            lua_rawseti( L, mainT, j + 1 );
+    }
+    lua_pop(L,2); // metaT, mainT
+    while( ok )
+    {
+        QByteArray name;
+        in >> name;
+        if( name.isEmpty() )
+            break;
+        ok = readValue( in, refs );
+        if( ok )
+            lua_setglobal( L, name.constData() );
+    }
+    lua_settop(L,top);
+    return ok && in.status() == QDataStream::Ok;
+}
+
+bool LjObjectManager::readValue(QDataStream& in, int refs)
+{
+    lua_State* L = d_lua->getCtx();
+    luaL_checkstack( L, 8, "snapshot too deep" );
+    quint8 tag = StNil;
+    in >> tag;
+    if( in.status() != QDataStream::Ok )
+        return false;
+    switch( tag )
+    {
+    case StNil:
+        lua_pushnil(L);
+        break;
+    case StFalse:
+    case StTrue:
+        lua_pushboolean( L, tag == StTrue );
+        break;
+    case StNumber:
+    case StDouble:
+        {
+            double d;
+            in >> d;
+            if( tag == StDouble )
+            {
+                lua_getglobal( L, "_primitives" );
+                lua_getfield( L, -1, "_newDouble" );
+                lua_remove( L, -2 );
+                lua_pushnumber( L, d );
+                lua_call( L, 1, 1 );
+            }else
+                lua_pushnumber( L, d );
+        }
+        break;
+    case StString:
+    case StSymbol:
+        {
+            QByteArray str;
+            in >> str;
+            if( tag == StSymbol )
+            {
+                lua_getglobal( L, "_primitives" );
+                lua_getfield( L, -1, "_newSymbol" );
+                lua_remove( L, -2 );
+                lua_pushlstring( L, str.constData(), str.size() );
+                lua_call( L, 1, 1 );
+            }else
+                lua_pushlstring( L, str.constData(), str.size() );
+        }
+        break;
+    case StClass:
+    case StMeta:
+        {
+            QByteArray name;
+            in >> name;
+            lua_getglobal( L, name.constData() );
+            if( tag == StClass )
+            {
+                lua_getfield( L, -1, "_class" );
+                lua_remove( L, -2 );
+            }
+        }
+        break;
+    case StSystem:
+        lua_getglobal( L, "system" );
+        break;
+    case StRef:
+        {
+            quint32 id;
+            in >> id;
+            lua_rawgeti( L, refs, id );
+        }
+        break;
+    case StTable:
+        {
+            quint32 id;
+            QByteArray cls;
+            in >> id >> cls;
+            lua_createtable(L,0,0);
+            const int t = lua_gettop(L);
+            if( !cls.isEmpty() )
+            {
+                lua_getglobal( L, cls.constData() );
+                lua_getfield( L, -1, "_class" );
+                lua_remove( L, -2 );
+                lua_setmetatable( L, t );
+            }
+            lua_pushvalue( L, t );
+            lua_rawseti( L, refs, id );
+            while( true )
+            {
+                if( !readValue( in, refs ) )
+                    return false;
+                if( lua_isnil(L,-1) )
+                {
+                    lua_pop(L,1);
+                    break;
+                }
+                if( !readValue( in, refs ) )
+                    return false;
+                lua_rawset( L, t );
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+    return in.status() == QDataStream::Ok;
 }
 
 QString LjObjectManager::pathInDir(const QString& dir, const QString& name)
 {
-    QDir homeDir( QFileInfo(d_mainClass->d_loc.d_source).absoluteDir() );
+    QDir homeDir( QFileInfo(d_mainPath).absoluteDir() );
     homeDir.mkdir(dir);
     homeDir.cd(dir);
     return homeDir.absoluteFilePath( name );
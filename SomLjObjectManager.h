@@ -22,9 +22,13 @@
 
 #include <QObject>
 #include <QStringList>
+#include <QSet>
 #include <Som/SomAst.h>
+#include <Som/SomLjbcCompiler2.h>
 
 class QIODevice;
+class QDataStream;
+struct lua_State;
 
 namespace Lua
 {
@@ -37,9 +41,25 @@ namespace Som
     {
     public:
         typedef QList<QPair<QString,QString> > GeneratedFiles; // source path -> generated path
+        struct ClassImage
+        {
+            // what the Lua side of a class needs; built from the AST or read from the cache
+            QByteArray d_name, d_superName; // d_superName is empty for Object
+            QString d_source;
+            QByteArrayList d_fields, d_classFields; // including the inherited ones
+            QByteArrayList d_methods; // mapped names of the own instance methods
+            QByteArrayList d_inherited, d_classInherited; // mapped names of the methods of the superclass
+            QList<QPair<QByteArray,QByteArray> > d_primitives; // name in _primitives, ^ if class level -> mapped name
+            QByteArrayList d_selfBound; // see bindSends
+            QByteArrayList d_targets; // see bindSends
+            QByteArray d_code;
+        };
         explicit LjObjectManager(Lua::Engine2*, QObject *parent = 0);
         bool load( const QString& mainSomFile, const QStringList& paths = QStringList() );
         bool loadAtRuntime( const QByteArray& className );
+        bool saveBundle( const QString& path, bool withState = false ); // withState: snapshot of the class fields and globals
+        bool loadBundle( const QString& path ); // instead of load with the same options; the bundle includes SomPrimitives
+        bool warmUp( const QByteArray& selector );
         bool setArgs( const QStringList& );
         bool run();
         const QStringList& getErrors() const { return d_errors; }
@@ -48,8 +68,14 @@ namespace Som
         QByteArrayList getClassNames() const;
         void setGenLua( bool on ) { d_genLua = on; }
         void setGenClosures( bool on ) { d_genClosures = on; }
+        void setWriteFiles( bool on ) { d_writeFiles = on; } // the generated code is also written to Lua/
+        void setOptions( quint32 o ) { d_options = o; } // see LjbcCompiler2::Option
+        void setCacheDir( const QString& dir ) { d_cacheDir = dir; } // empty: no cache
+        quint32 getOptions() const { return d_options; }
         QString pathInDir( const QString& dir, const QString& name );
     protected:
+        bool loadClasses();
+        void parseAll();
         bool parseMain(const QString& mainFile);
         Ast::Ref<Ast::Class> parseFile( const QString& file );
         bool error( const Ast::Loc&, const QString& msg );
@@ -61,27 +87,73 @@ namespace Som
         Ast::Ref<Ast::Class> getOrLoadClassImp( const char* className, bool* loaded = 0 );
         bool handleUnresolved();
         bool instantiateClasses();
-        bool instantiateClass( Ast::Class* );
+        ClassImage imageOf( Ast::Class* ) const;
+        bool instantiateClass( const ClassImage& );
+        void connectObjectMeta( const ClassImage& );
+        void connectValueTypes();
         bool compileMethods( Ast::Class* );
+        void assignNlrTokens( Ast::Class* );
+        bool installClass( const ClassImage& );
+        bool defineRunSom();
+        QByteArray cacheKey() const;
+        bool loadFromCache();
+        bool restoreAsts();
+        bool installImages();
+        bool toBytecode( const QByteArray& code, const QByteArray& name, QByteArray& out );
+        bool snapshot( QDataStream&, bool write );
+        static int snapshotImp( lua_State* );
+        bool writeState( QDataStream& );
+        bool writeValue( QDataStream&, int refs, int value, quint32& count );
+        bool readState( QDataStream& );
+        bool readValue( QDataStream&, int refs );
+        void saveToCache();
         void writeLua( QIODevice* out, Ast::Class* cls);
         void writeBc( QIODevice* out, Ast::Class* cls);
+        void bindSends( Ast::Class*, LjbcCompiler2::Module&, const QList<Ast::Method*>& customized );
+        void bindSuperSends( Ast::Class*, LjbcCompiler2::Module& );
+        bool isOverridden( Ast::Class*, const QByteArray& name, bool classLevel ) const;
+        QList<Ast::Class*> invalidatedBy( int firstNew, const QSet<QByteArray>& nlrSelectors ) const;
+        QSet<QByteArray> nonLocalReturnSelectors() const;
+        bool hasIntegerPrimitives() const;
+        bool isBindable( Ast::Class*, const QByteArray& name ) const;
+        QList<Ast::Method*> customizedMethods( Ast::Class* ) const;
+        QHash<QByteArray,quint32> nonEscapingArgs() const;
+        void findReusedBlocks( Ast::Class*, LjbcCompiler2::Module& );
     private:
         class ResolveIdents;
+        class ParseJob;
+        struct Parsed
+        {
+            Ast::Ref<Ast::Class> d_class;
+            QStringList d_errors;
+            QSet<QByteArray> d_names; // the superclass and the identifiers which can refer to classes
+        };
+        QHash<QString,Parsed> d_parsed; // file -> class parsed in advance by parseAll
         Lua::Engine2* d_lua;
         QStringList d_classPaths;
         QStringList d_errors;
         QString d_mainPath;
         Ast::Ref<Ast::Class> d_mainClass;
+        QByteArray d_mainName, d_runSelector;
         typedef QHash<const char*,Ast::Ref<Ast::Class> > Classes;
         Classes d_classes;
         QList<Ast::Class*> d_loadingOrder;
+        QList<ClassImage> d_images; // instantiated classes in loading order
+        QHash<Ast::Class*,QSet<QByteArray> > d_selfBound; // class -> selectors of bound self sends, class level with ^
+        QHash<Ast::Class*,QSet<Ast::Class*> > d_targets; // class -> other classes with methods it binds or inlines
+        QSet<QByteArray> d_nlrSelectors; // selectors of sends which can see a non-local return
+        QHash<QByteArray,quint32> d_nonEscaping; // selector -> bits of the args no implementation keeps
+        QSet<QByteArray> d_runtimeGlobals; // not part of the snapshot, see writeState
+        quint32 d_nlrTokens; // the last Method::d_nlrToken assigned
         quint32 d_instantiated;
         QByteArray _nil, _Class, _Object;
         QHash<const char*,quint8> d_keywords;
         Ast::Ref<Ast::Variable> d_system;
         QList<Ast::Ident*> d_unresolved;
         GeneratedFiles d_generated;
-        bool d_genLua, d_genClosures;
+        QString d_cacheDir;
+        bool d_genLua, d_genClosures, d_writeFiles;
+        quint32 d_options;
     };
 }
 
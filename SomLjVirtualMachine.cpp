@@ -79,6 +79,23 @@ static int hashOf(lua_State * L)
     case LUA_TLIGHTUSERDATA:
         h = (lua_Integer)lua_topointer( L, 1 );
         break;
+    default:
+        if( qstrcmp( lua_typename( L, lua_type(L,1) ), "cdata" ) == 0 )
+        {
+            // Doubles are the only cdata values of SOM; equal values must have equal hashes, also the Integers
+            lua_getfield( L, 1, "_dbl" );
+            const double d = lua_tonumber(L,-1);
+            lua_pop(L,1);
+            if( d >= -2147483648.0 && d <= 2147483647.0 && d == double(int(d)) )
+                h = int(d);
+            else
+            {
+                quint64 bits;
+                ::memcpy( &bits, &d, sizeof(d) );
+                h = int( bits ^ ( bits >> 32 ) );
+            }
+        }
+        break;
     }
 
     lua_pushinteger( L, h );
@@ -429,6 +446,7 @@ int main(int argc, char *argv[])
     }
     vm.setGenLua(lua);
     vm.setGenClosures(clo);
+    vm.getOm()->setWriteFiles(ide || debugger); // the IDE and debugger show the generated files
     if( !vm.load(somFile, somPaths) )
         return -1;
 
@@ -37,7 +37,8 @@ SOURCES += \
     SomLjLibFfi.cpp \
     SomLjbcCompiler.cpp \
     ../LjTools/LjBcDebugger.cpp \
-    SomLjbcCompiler2.cpp
+    SomLjbcCompiler2.cpp \
+    SomLjbcPeephole.cpp
 
 HEADERS  += \ 
     SomLjVirtualMachine.h \
@@ -48,7 +49,8 @@ HEADERS  += \
     SomLuaTranspiler.h \
     SomLjbcCompiler.h \
     ../LjTools/LjBcDebugger.h \
-    SomLjbcCompiler2.h
+    SomLjbcCompiler2.h \
+    SomLjbcPeephole.h
 
 DEFINES += LUAIDE_EMBEDDED
 include( ../LjTools/LuaIde.pri )
@@ -29,7 +29,7 @@ struct LjBcGen: public Visitor
 {
     Lua::JitComposer& bc;
 
-    LjBcGen(Lua::JitComposer& _bc):bc(_bc){}
+    LjBcGen(Lua::JitComposer& _bc):bc(_bc),tailSend(0),tailCalled(false){}
 
     struct Ctx
     {
@@ -64,6 +64,45 @@ struct LjBcGen: public Visitor
     };
     QList<Ctx> ctx;
     QList<quint8> slotStack;
+    typedef QHash<Block*,quint8> BlockCache;
+    BlockCache blockCache; // block literal in a loop -> slot with its instance once created
+    MsgSend* tailSend; // if this send is compiled as a regular call it is a tail call
+    bool tailCalled; // tailSend was compiled as a tail call, so no RET is required
+
+    struct FindBlockLiterals : public Visitor
+    {
+        // collects the non-inlined block literals which are instantiated by the function itself
+        QList<Block*> blocks;
+        void visit( MsgSend* s )
+        {
+            s->d_receiver->accept(this);
+            for( int i = 0; i < s->d_args.size(); i++ )
+                s->d_args[i]->accept(this);
+        }
+        void visit( Block* b )
+        {
+            if( !b->d_func->d_inline )
+            {
+                blocks << b;
+                return;
+            }
+            for( int i = 0; i < b->d_func->d_body.size(); i++ )
+                b->d_func->d_body[i]->accept(this);
+        }
+        void visit( Return* r )
+        {
+            r->d_what->accept(this);
+        }
+        void visit( Assig* a )
+        {
+            a->d_rhs->accept(this);
+        }
+        void visit( ArrayLiteral* a )
+        {
+            for( int i = 0; i < a->d_elements.size(); i++ )
+                a->d_elements[i]->accept(this);
+        }
+    };
 
     bool inline error( const Loc& l, const QString& msg )
     {
@@ -320,8 +359,37 @@ struct LjBcGen: public Visitor
 
     }
 
+    QList<Block*> cacheBlockLiterals( const QList<Expression*>& loop, const Loc& loc )
+    {
+        // The closures of the block literals in a loop are created only in the first iteration; the loop doesn't
+        // close the upvalues, so the closures of all iterations would refer to the same variables anyway.
+        FindBlockLiterals find;
+        for( int i = 0; i < loop.size(); i++ )
+            loop[i]->accept(&find);
+        QList<Block*> res;
+        for( int i = 0; i < find.blocks.size(); i++ )
+        {
+            Block* b = find.blocks[i];
+            if( blockCache.contains(b) )
+                continue; // already cached by an enclosing loop
+            const int slot = ctx.back().buySlots(1);
+            bc.KNIL( slot, 1, loc.packed() );
+            blockCache[b] = slot;
+            res << b;
+        }
+        return res;
+    }
+
+    void releaseBlockLiterals( const QList<Block*>& blocks )
+    {
+        for( int i = 0; i < blocks.size(); i++ )
+            ctx.back().sellSlots( blockCache.take(blocks[i]) );
+    }
+
     void inlineWhile( MsgSend* s )
     {
+        const QList<Block*> cached = cacheBlockLiterals( QList<Expression*>() << s->d_receiver.data()
+                                                         << s->d_args.first().data(), s->d_loc );
         bc.LOOP( ctx.back().pool.d_frameSize, 0, s->d_loc.packed() ); // while true do
         const quint32 startLoop = bc.getCurPc();
         const int res = ctx.back().buySlots(1);
@@ -355,10 +423,96 @@ struct LjBcGen: public Visitor
         bc.jumpToLoop( startLoop, ctx.back().pool.d_frameSize, s->d_loc.packed() ); // loop to start
 
         bc.patch( label );
+        releaseBlockLiterals(cached);
 
         slotStack.push_back(res);
     }
 
+    void inlineAndOr( MsgSend* s )
+    {
+        // and: answers false and or: answers true without evaluating the block; otherwise the block is the result
+        const bool isOr = s->d_flowControl == Or;
+        emitReceiver(s,false);
+        // the result is in slotStack.back()
+        const int res = slotStack.back();
+        if( isOr )
+            bc.IST(res,s->d_loc.packed());
+        else
+            bc.ISF(res,s->d_loc.packed());
+        bc.JMP(ctx.back().pool.d_frameSize,0,s->d_loc.packed());
+        const int label = bc.getCurPc();
+
+        inlineIfBlock(s->d_args.first().data());
+        // the result is in slotStack.back()
+        bc.MOV(res,slotStack.back(),s->d_loc.packed());
+        ctx.back().sellSlots(slotStack.back());
+        slotStack.pop_back();
+        bc.JMP(ctx.back().pool.d_frameSize,0,s->d_loc.packed());
+        const int label2 = bc.getCurPc();
+
+        bc.patch(label);
+        bc.KSET( res, isOr, s->d_loc.packed() );
+        bc.patch(label2);
+    }
+
+    void inlineTest( MsgSend* s )
+    {
+        emitReceiver(s,false);
+        // the result is in slotStack.back()
+        const int res = slotStack.back();
+        if( s->d_flowControl == Not )
+        {
+            bc.NOT(res,res,s->d_loc.packed());
+            return;
+        }
+        if( s->d_flowControl == IsNil )
+            bc.ISEQ( res, QVariant(), s->d_loc.packed() );
+        else
+            bc.ISNE( res, QVariant(), s->d_loc.packed() );
+        bc.JMP(ctx.back().pool.d_frameSize,0,s->d_loc.packed());
+        const int label = bc.getCurPc();
+        bc.KSET( res, false, s->d_loc.packed() );
+        bc.JMP(ctx.back().pool.d_frameSize,0,s->d_loc.packed());
+        const int label2 = bc.getCurPc();
+        bc.patch(label);
+        bc.KSET( res, true, s->d_loc.packed() );
+        bc.patch(label2);
+    }
+
+    void inlineIfNil( MsgSend* s )
+    {
+        // like in Object.som and Nil.som the receiver is the result if the block is not evaluated
+        emitReceiver(s,false);
+        // the result is in slotStack.back()
+        const int res = slotStack.back();
+        if( s->d_flowControl == IfNotNil )
+            bc.ISEQ( res, QVariant(), s->d_loc.packed() );
+        else
+            bc.ISNE( res, QVariant(), s->d_loc.packed() );
+        bc.JMP(ctx.back().pool.d_frameSize,0,s->d_loc.packed());
+        const int label = bc.getCurPc();
+
+        inlineIfBlock(s->d_args.first().data());
+        // the result is in slotStack.back()
+        bc.MOV(res,slotStack.back(),s->d_loc.packed());
+        ctx.back().sellSlots(slotStack.back());
+        slotStack.pop_back();
+
+        if( s->d_flowControl == IfNilIfNotNil )
+        {
+            bc.JMP(ctx.back().pool.d_frameSize,0,s->d_loc.packed());
+            const int label2 = bc.getCurPc();
+            bc.patch(label);
+            inlineIfBlock(s->d_args.last().data());
+            // the result is in slotStack.back()
+            bc.MOV(res,slotStack.back(),s->d_loc.packed());
+            ctx.back().sellSlots(slotStack.back());
+            slotStack.pop_back();
+            bc.patch(label2);
+        }else
+            bc.patch(label);
+    }
+
     static inline QString printLoc(const Loc& loc )
     {
         return QString("%1:%2:%3").arg(QFileInfo(loc.d_source).baseName()).arg(loc.d_line).arg(loc.d_col);
@@ -393,6 +547,22 @@ struct LjBcGen: public Visitor
         case WhileFalse:
             inlineWhile(s);
             return;
+        case And:
+        case Or:
+            inlineAndOr(s);
+            return;
+        case Not:
+        case IsNil:
+        case NotNil:
+            inlineTest(s);
+            return;
+        case IfNil:
+        case IfNotNil:
+        case IfNilIfNotNil:
+            inlineIfNil(s);
+            return;
+        default:
+            break; // the loops from ToDo are not inlined with closures
         }
 
         emitReceiver(s,false);
@@ -419,6 +589,18 @@ struct LjBcGen: public Visitor
             ctx.back().sellSlots(slotStack.back());
             slotStack.pop_back();
         }
+        if( s == tailSend )
+        {
+            // all results of the callee, including a passing non-local return, are the results of this function
+            closeUpvals();
+            bc.CALLT(args,s->d_args.size() + 1, s->d_loc.packed() );
+            tailCalled = true;
+            const int res = ctx.back().buySlots(1);
+            slotStack.push_back(res);
+            ctx.back().sellSlots(args, s->d_args.size() + 2);
+            return;
+        }
+
         bc.CALL(args,2,s->d_args.size() + 1, s->d_loc.packed() );
 
         if( ctx.back().block || !s->d_inMethod->d_hasNonLocalReturnIfInlined )
@@ -437,9 +619,8 @@ struct LjBcGen: public Visitor
             bc.ISF( args+1, s->d_loc.packed() );
             bc.JMP(ctx.back().pool.d_frameSize,0, s->d_loc.packed() );
             const int label = bc.getCurPc();
-            const int tmp = ctx.back().buySlots(1);
-            bc.KSET( tmp, (ptrdiff_t)owningMethod(), s->d_loc.packed() );
-            bc.ISEQ( args+1, tmp, s->d_loc.packed() );
+            Q_ASSERT( owningMethod()->d_nlrToken != 0 );
+            bc.ISEQ( args+1, QVariant(int(owningMethod()->d_nlrToken)), s->d_loc.packed() );
             bc.JMP(ctx.back().pool.d_frameSize,1, s->d_loc.packed() );
             const int label2 = bc.getCurPc();
             closeUpvals();
@@ -458,19 +639,35 @@ struct LjBcGen: public Visitor
         ctx.back().sellSlots(args, s->d_args.size() + 2);
     }
 
+    bool canTailCall( Expression* e, bool nonLocal ) const
+    {
+        // a send in return position can be a tail call if the function doesn't have to check for a non-local
+        // return targeting it; blocks pass all non-local returns through
+        if( nonLocal || e->getTag() != Thing::T_MsgSend )
+            return false;
+        return ctx.back().block || !owningMethod()->d_hasNonLocalReturnIfInlined;
+    }
+
     virtual void visit( Return* r )
     {
+        MsgSend* outer = tailSend;
+        tailSend = canTailCall( r->d_what.data(), ctx.back().block && r->d_nonLocalIfInlined ) ?
+                    static_cast<MsgSend*>( r->d_what.data() ) : 0;
         r->d_what->accept(this);
+        tailSend = outer;
         // the result is in slotStack.back()
-        if( ctx.back().block && r->d_nonLocalIfInlined )
+        if( tailCalled )
+            tailCalled = false; // the function already returned with the results of the callee
+        else if( ctx.back().block && r->d_nonLocalIfInlined )
         {
             // Block Level
             // an explicit return in a block is always a non-local return
             closeUpvals();
             const int slot = ctx.back().buySlots(2);
             bc.MOV(slot,slotStack.back(),r->d_loc.packed());
-            // use the AST address of the Method as id (RISK: 64 bit architectures)
-            bc.KSET(slot+1, (ptrdiff_t)owningMethod(), r->d_loc.packed() );
+            // the token identifies the method to return from
+            Q_ASSERT( owningMethod()->d_nlrToken != 0 );
+            bc.KSET(slot+1, int(owningMethod()->d_nlrToken), r->d_loc.packed() );
             bc.RET( slot, 2, r->d_loc.packed() );
             ctx.back().sellSlots(slot,2);
         }else
@@ -549,10 +746,18 @@ struct LjBcGen: public Visitor
             b->d_func->d_vars[i]->d_slot = var;
         }
 
+        MsgSend* outer = tailSend;
         for( int i = 0; i < b->d_func->d_body.size(); i++ )
         {
+            const bool last = i == b->d_func->d_body.size() - 1 &&
+                    b->d_func->d_body.last()->getTag() != Thing::T_Return;
+            tailSend = last && canTailCall( b->d_func->d_body[i].data(), false ) ?
+                        static_cast<MsgSend*>( b->d_func->d_body[i].data() ) : 0;
             b->d_func->d_body[i]->accept( this );
-            if( i == b->d_func->d_body.size() - 1 && b->d_func->d_body.last()->getTag() != Thing::T_Return )
+            tailSend = 0;
+            if( tailCalled )
+                tailCalled = false;
+            else if( last )
             {
                 // if last return is missing, add it and return last expression result
                 closeUpvals();
@@ -561,6 +766,7 @@ struct LjBcGen: public Visitor
             ctx.back().sellSlots(slotStack.back());
             slotStack.pop_back();
         }
+        tailSend = outer;
 
         if( b->d_func->d_body.isEmpty() )
         {
@@ -578,20 +784,38 @@ struct LjBcGen: public Visitor
         const int res = ctx.back().buySlots(1);
         slotStack.push_back(res);
 
+        int label = -1;
+        const BlockCache::const_iterator cached = blockCache.find(b);
+        if( cached != blockCache.end() )
+        {
+            // skip the instantiation if this was done in an earlier iteration of the loop
+            bc.ISNE( cached.value(), QVariant(), b->d_loc.packed() );
+            bc.JMP(ctx.back().pool.d_frameSize,0,b->d_loc.packed());
+            label = bc.getCurPc();
+        }
+
         // return a table which carries the function
         const int f = ctx.back().buySlots(1);
         bc.FNEW( f, id, b->d_loc.packed() );
-        bc.TNEW(res,0,0,b->d_loc.packed());
+        bc.TNEW(res,0,1,b->d_loc.packed());
         bc.TSET(f,res,"_f",b->d_loc.packed());
         ctx.back().sellSlots(f);
         emitSetmetatable( res, "Block", b->d_loc );
+
+        if( label >= 0 )
+        {
+            bc.MOV( cached.value(), res, b->d_loc.packed() );
+            bc.patch(label);
+            bc.MOV( res, cached.value(), b->d_loc.packed() );
+        }
     }
 
     virtual void visit( ArrayLiteral* a )
     {
         const int res = ctx.back().buySlots(1);
         slotStack.push_back(res);
-        bc.TNEW(res,0,0,a->d_loc.packed());
+        // pre-sized for the elements at index 1..n
+        bc.TNEW(res, a->d_elements.size() < 2047 ? a->d_elements.size() + 1 : 0, 0, a->d_loc.packed());
         emitSetmetatable( res, "Array", a->d_loc );
 
         for( int i = 0; i < a->d_elements.size(); i++ )
@@ -628,7 +852,7 @@ struct LjBcGen: public Visitor
         bc.KSET(str, LuaTranspiler::escape(string), loc.packed() );
         const int res = ctx.back().buySlots(1);
         slotStack.push_back(res);
-        bc.TNEW(res,0,0,loc.packed());
+        bc.TNEW(res,0,1,loc.packed());
         bc.TSET(str,res,"_str",loc.packed());
         ctx.back().sellSlots(str);
         emitSetmetatable( res, cls, loc );
@@ -642,12 +866,26 @@ struct LjBcGen: public Visitor
     {
         emitString( QByteArray(1,c->d_ch), "String", c->d_loc );
     }
+    void emitSymbol( const QByteArray& symbol, const Loc& loc )
+    {
+        // Symbols are interned by _primitives so that equal Symbols are identical
+        const int res = ctx.back().buySlots(1);
+        slotStack.push_back(res);
+        const int args = ctx.back().buySlots(2,true);
+        bc.GGET(args,"_primitives",loc.packed() );
+        bc.TGET(args,args,"_newSymbol",loc.packed() );
+        bc.KSET(args+1, LuaTranspiler::escape(symbol), loc.packed() );
+        bc.CALL(args,1,1,loc.packed());
+        bc.MOV(res,args,loc.packed());
+        ctx.back().sellSlots(args,2);
+    }
+
     virtual void visit( Symbol* s)
     {
         if( s->d_sym.startsWith('"') )
-            emitString( s->d_sym.mid(1,s->d_sym.size() - 2), "Symbol", s->d_loc );
+            emitSymbol( s->d_sym.mid(1,s->d_sym.size() - 2), s->d_loc );
         else
-            emitString( LuaTranspiler::map(s->d_sym), "Symbol", s->d_loc );
+            emitSymbol( LuaTranspiler::map(s->d_sym), s->d_loc );
     }
 
     virtual void visit( Number* n )
@@ -656,15 +894,17 @@ struct LjBcGen: public Visitor
         slotStack.push_back(res);
         if( n->d_real )
         {
-            const int dbl = ctx.back().buySlots(1);
+            // Doubles are FFI structs created by _primitives
+            const int args = ctx.back().buySlots(2,true);
+            bc.GGET(args,"_primitives",n->d_loc.packed() );
+            bc.TGET(args,args,"_newDouble",n->d_loc.packed() );
             bool ok;
-            bc.KSET(dbl, n->toNumber(&ok), n->d_loc.packed() );
+            bc.KSET(args+1, n->toNumber(&ok), n->d_loc.packed() );
             if( !ok )
                 error(n->d_loc, QString("invalid real %1").arg(n->d_num.constData()) );
-            bc.TNEW(res,0,0,n->d_loc.packed());
-            bc.TSET(dbl,res,"_dbl",n->d_loc.packed());
-            ctx.back().sellSlots(dbl);
-            emitSetmetatable( res, "Double", n->d_loc );
+            bc.CALL(args,1,1,n->d_loc.packed());
+            bc.MOV(res,args,n->d_loc.packed());
+            ctx.back().sellSlots(args,2);
         }else
         {
             bool ok;
@@ -792,6 +1032,11 @@ bool LjbcCompiler::translate(Lua::JitComposer& bc, Ast::Method* m)
     return false;
 }
 
+QByteArray LjbcCompiler::buildStamp()
+{
+    return __DATE__ " " __TIME__; // changes whenever this file is compiled
+}
+
 
 NoMoreFreeSlots::NoMoreFreeSlots(const Loc& loc)
 {
@@ -40,6 +40,7 @@ namespace Som
     {
     public:
         static bool translate( Lua::JitComposer&, Ast::Method* );
+        static QByteArray buildStamp(); // see LjObjectManager::cacheKey
 
     private:
         LjbcCompiler();
@@ -22,20 +22,25 @@
 #include "SomLexer.h"
 #include <QFileInfo>
 #include <QtDebug>
+#include <math.h>
 using namespace Som;
 using namespace Som::Ast;
 
 /*
- NOTE: param arrays are used instead of param and local slots. A param array has values at the indices corresponding
- to the param and local slots, i.e. 0 ... Variable::d_vars.size()-1. The param array of the calling function is
- at index Variable::d_vars.size(); the param array of the calling function of the calling function is at
- index Variable::d_vars.size()+1, and so on.
+ NOTE: params and locals live in the slots of the function (slot 0 is self or the block instance, followed by
+ params, locals and locals of inlined blocks, i.e. Variable::d_slot). Only variables which are accessed by
+ another (non-inlined) block function (Variable::d_captured) are kept in a param array instead. A param array
+ has values at the indices corresponding to the slots; a method param array has self at index 0.
+ The param array is created only if the function has captured variables; the param array of the enclosing
+ function of inlined level n is at index n-1 of the block instance (which is passed in slot 0).
 */
 struct LjBcGen2: public Visitor
 {
     Lua::JitComposer& bc;
 
-    LjBcGen2(Lua::JitComposer& _bc, Method* m, Block* b):bc(_bc),meth(m), block(b), ctx(m,b) {}
+    LjBcGen2(Lua::JitComposer& _bc, LjbcCompiler2::Module& mod, Method* m, Block* b):bc(_bc),
+        module(mod),meth(m), block(b), ctx(m,b), genericLoops(0), inl(0), tailSend(0), tailCalled(false),
+        selfSlot(-1), dest(-1) {}
 
     struct NoMoreFreeSlots {};
 
@@ -43,9 +48,10 @@ struct LjBcGen2: public Visitor
     {
         Function* fun;
         Lua::JitComposer::SlotPool pool;
-        typedef QHash<Function*,quint16> Upvals;
+        typedef QHash<quint8,quint16> Upvals; // module slot -> upvalue number
         Upvals upvals;
-        Ctx(Method* m, Block* b)
+        int paramTable;
+        Ctx(Method* m, Block* b):paramTable(-1)
         {
             if( b )
                 fun = b->d_func.data();
@@ -68,18 +74,175 @@ struct LjBcGen2: public Visitor
         quint16 getUpvalNr(Function* f)
         {
             Q_ASSERT( f->d_slotValid );
-            Upvals::const_iterator i = upvals.find(f);
+            return getUpvalNr( f->d_slot );
+        }
+        quint16 getUpvalNr(quint8 moduleSlot)
+        {
+            Upvals::const_iterator i = upvals.find(moduleSlot);
             if( i != upvals.end() )
                 return i.value();
             const int nr = upvals.size();
-            upvals[ f ] = nr;
+            upvals[ moduleSlot ] = nr;
             return nr;
         }
     };
+    LjbcCompiler2::Module& module;
     Ctx ctx;
     QList<quint8> slotStack;
     Method* meth;
     Block* block;
+    int genericLoops; // nesting depth of inlined loops without FORI
+    struct Inlining
+    {
+        Method* callee;
+        quint8 self;
+        QList<quint8> args;
+    };
+    Inlining* inl; // the body of inl->callee is being inlined; self and the params are in slots
+    typedef QHash<Block*,quint8> BlockCache;
+    BlockCache blockCache; // block literal in a loop -> slot with its instance once created
+    MsgSend* tailSend; // if this send is compiled as a regular call it is a tail call
+    bool tailCalled; // tailSend was compiled as a tail call, so no RET is required
+    int selfSlot; // slot of the method level self loaded by the block prologue or -1
+    QHash<int,quint8> outerTables; // inlined level -> slot of the outer param table loaded by the block prologue
+    int dest; // the slot the next leaf expression is evaluated into or -1
+    QSet<Variable*> intVars; // variables which statically hold an Integer where they are visible
+    typedef QHash<Block*,quint8> Reusing;
+    Reusing reusing; // reused block literal passed by the current send -> slots of the param tables to restore
+
+    struct FindAssig : public Visitor
+    {
+        // checks whether a variable is assigned anywhere in an expression, including all nested blocks
+        Variable* var;
+        bool found;
+        FindAssig(Variable* v):var(v),found(false){}
+        void visit( MsgSend* s )
+        {
+            s->d_receiver->accept(this);
+            for( int i = 0; i < s->d_args.size(); i++ )
+                s->d_args[i]->accept(this);
+        }
+        void visit( Block* b )
+        {
+            for( int i = 0; i < b->d_func->d_body.size(); i++ )
+                b->d_func->d_body[i]->accept(this);
+        }
+        void visit( Return* r )
+        {
+            r->d_what->accept(this);
+        }
+        void visit( Assig* a )
+        {
+            if( a->d_lhs->d_resolved == var )
+                found = true;
+            a->d_rhs->accept(this);
+        }
+        void visit( ArrayLiteral* a )
+        {
+            for( int i = 0; i < a->d_elements.size(); i++ )
+                a->d_elements[i]->accept(this);
+        }
+    };
+
+    struct FindOuterRefs : public Visitor
+    {
+        // collects the references of a block function to self and to the param tables of enclosing functions
+        Function* fun;
+        bool self;
+        QSet<int> levels;
+        QList<Block*> blocks; // non-inlined block literals, which copy the outer param tables
+        FindOuterRefs(Function* f):fun(f),self(false){}
+        void use( Variable* v )
+        {
+            switch( v->d_kind )
+            {
+            case Variable::InstanceLevel:
+            case Variable::ClassLevel:
+                self = true;
+                break;
+            case Variable::Argument:
+            case Variable::Temporary:
+                if( v->d_inlinedOwner != fun )
+                    levels << v->d_inlinedOwner->d_inlinedLevel;
+                break;
+            default:
+                break;
+            }
+        }
+        void visit( Ident* id )
+        {
+            if( id->d_keyword == Expression::_super )
+                self = true; // self in blocks is resolved to the method level variable, but super sends pass it
+            else if( id->d_resolved && id->d_resolved->getTag() == Thing::T_Variable )
+                use( static_cast<Variable*>(id->d_resolved) );
+        }
+        void visit( MsgSend* s )
+        {
+            s->d_receiver->accept(this);
+            for( int i = 0; i < s->d_args.size(); i++ )
+                s->d_args[i]->accept(this);
+        }
+        void visit( Block* b )
+        {
+            if( !b->d_func->d_inline )
+            {
+                blocks << b;
+                return;
+            }
+            for( int i = 0; i < b->d_func->d_body.size(); i++ )
+                b->d_func->d_body[i]->accept(this);
+        }
+        void visit( Return* r )
+        {
+            r->d_what->accept(this);
+        }
+        void visit( Assig* a )
+        {
+            if( a->d_lhs->d_resolved && a->d_lhs->d_resolved->getTag() == Thing::T_Variable )
+                use( static_cast<Variable*>(a->d_lhs->d_resolved) );
+            a->d_rhs->accept(this);
+        }
+        void visit( ArrayLiteral* a )
+        {
+            for( int i = 0; i < a->d_elements.size(); i++ )
+                a->d_elements[i]->accept(this);
+        }
+    };
+
+    struct FindBlockLiterals : public Visitor
+    {
+        // collects the non-inlined block literals which are instantiated by the function itself
+        QList<Block*> blocks;
+        void visit( MsgSend* s )
+        {
+            s->d_receiver->accept(this);
+            for( int i = 0; i < s->d_args.size(); i++ )
+                s->d_args[i]->accept(this);
+        }
+        void visit( Block* b )
+        {
+            if( !b->d_func->d_inline )
+            {
+                blocks << b;
+                return;
+            }
+            for( int i = 0; i < b->d_func->d_body.size(); i++ )
+                b->d_func->d_body[i]->accept(this);
+        }
+        void visit( Return* r )
+        {
+            r->d_what->accept(this);
+        }
+        void visit( Assig* a )
+        {
+            a->d_rhs->accept(this);
+        }
+        void visit( ArrayLiteral* a )
+        {
+            for( int i = 0; i < a->d_elements.size(); i++ )
+                a->d_elements[i]->accept(this);
+        }
+    };
 
     bool inline error( const Loc& l, const QString& msg )
     {
@@ -105,7 +268,7 @@ struct LjBcGen2: public Visitor
         for( i = ctx.upvals.begin(); i != ctx.upvals.end(); ++i )
         {
             Lua::JitComposer::Upval u;
-            u.d_uv = i.key()->d_slot;
+            u.d_uv = i.key();
             u.d_isLocal = true;
             u.d_isRo = true; // only read function
             // u.d_name = QByteArray::number(i.key()->d_slot); // TODO
@@ -114,21 +277,40 @@ struct LjBcGen2: public Visitor
         return uvl;
     }
 
-    void createParamArray( Function* f )
+    static bool needsParamArray( Function* f )
     {
-        ctx.buySlots( 1 ); // self
-
-        const int params = ctx.buySlots( f->getParamCount() );
-        const int paramArray = ctx.buySlots(1);
-        bc.TNEW( paramArray, paramTableSize(f), 0, f->d_loc.packed() );
-        bc.TSETi( 0, paramArray, 0, f->d_loc.packed()); // copy self
-        for( int i = 0; i < f->getParamCount(); i++ )
-            bc.TSETi(i+1,paramArray,i+1,f->d_loc.packed()); // copy params to paramArray
-
-        bc.MOV(0,paramArray,f->d_loc.packed()); // param array is now in slot 0
+        if( f->getTag() == Thing::T_Method && static_cast<Method*>(f)->d_self->d_captured )
+            return true;
+        for( int i = 0; i < f->d_vars.size(); i++ )
+            if( f->d_vars[i]->d_captured )
+                return true;
+        for( int i = 0; i < f->d_inlineds.size(); i++ )
+            if( f->d_inlineds[i]->d_captured )
+                return true;
+        return false;
+    }
 
-        ctx.sellSlots(paramArray);
-        ctx.sellSlots(params); // params are now free again to be used as temporaries
+    void createFrame( Function* f )
+    {
+        const int params = f->getParamCount();
+        const int vars = f->d_vars.size() + f->d_inlineds.size();
+        const int base = ctx.buySlots( 1 + vars ); // self or block instance, params, locals and inlined locals
+        Q_ASSERT( base == 0 );
+        if( vars > params )
+            bc.KNIL( params + 1, vars - params, f->d_loc.packed() ); // locals are nil when entering the function
+
+        if( !needsParamArray(f) )
+            return; // all params and locals stay in their slots
+
+        ctx.paramTable = ctx.buySlots(1);
+        bc.TNEW( ctx.paramTable, paramTableSize(f), 0, f->d_loc.packed() );
+        if( f->getTag() == Thing::T_Method && static_cast<Method*>(f)->d_self->d_captured )
+            bc.TSETi( 0, ctx.paramTable, 0, f->d_loc.packed()); // copy self
+        for( int i = 0; i < params; i++ )
+        {
+            if( f->d_vars[i]->d_captured )
+                bc.TSETi(i+1,ctx.paramTable,i+1,f->d_loc.packed()); // copy captured params to paramArray
+        }
     }
 
     virtual void visit( Method* m )
@@ -150,9 +332,8 @@ struct LjBcGen2: public Visitor
         for( int i = 0; i < m->d_inlineds.size(); i++ )
             m->d_inlineds[i]->d_slot = i+m->d_vars.size()+1;
 
-        // TODO: only do this when method is upvalue source; use slots otherwise
-        createParamArray( m );
-        // slot 0 is now the param array and the other param slots are freed
+        createFrame( m );
+        // slot 0 is self, followed by params and locals; captured ones are in ctx.paramTable
 
         for( int i = 0; i < m->d_body.size(); i++ )
         {
@@ -163,10 +344,7 @@ struct LjBcGen2: public Visitor
 
         if( m->d_body.isEmpty() || m->d_body.last()->getTag() != Thing::T_Return )
         {
-            const int tmp = ctx.buySlots(1);
-            bc.TGETi( tmp, 0, 0, m->d_end.packed());
-            bc.RET( tmp, 1, m->d_end.packed() ); // return self
-            ctx.sellSlots(tmp);
+            bc.RET( 0, 1, m->d_end.packed() ); // return self
         }
 
         bc.setUpvals( getUpvals() );
@@ -175,6 +353,40 @@ struct LjBcGen2: public Visitor
         bc.FNEW( m->d_slot, id, m->d_loc.packed() );
     }
 
+    bool isShared( Block* b ) const
+    {
+        // blocks depending on no enclosing function are instantiated once by the module function
+        Q_ASSERT( meth->d_owner->getTag() == Thing::T_Class );
+        return static_cast<Class*>(meth->d_owner)->d_relocated.contains( b->d_func.data() );
+    }
+
+    QList<Block*> cacheBlockLiterals( const QList<Expression*>& loop, const Loc& loc )
+    {
+        // The block literals in a loop are instantiated only in the first iteration; all instances would be
+        // equivalent anyway because they carry the same param tables, which are allocated once per activation.
+        FindBlockLiterals find;
+        for( int i = 0; i < loop.size(); i++ )
+            loop[i]->accept(&find);
+        QList<Block*> res;
+        for( int i = 0; i < find.blocks.size(); i++ )
+        {
+            Block* b = find.blocks[i];
+            if( blockCache.contains(b) || isShared(b) )
+                continue; // already cached by an enclosing loop or not instantiated here at all
+            const int slot = ctx.buySlots(1);
+            bc.KNIL( slot, 1, loc.packed() );
+            blockCache[b] = slot;
+            res << b;
+        }
+        return res;
+    }
+
+    void releaseBlockLiterals( const QList<Block*>& blocks )
+    {
+        for( int i = 0; i < blocks.size(); i++ )
+            ctx.sellSlots( blockCache.take(blocks[i]) );
+    }
+
     void inlineBlock( Block* b )
     {
         Q_ASSERT( b->d_func->d_inline );
@@ -208,197 +420,1231 @@ struct LjBcGen2: public Visitor
                 bc.TGET(slot,slot,"_class",s->d_loc.packed());
             bc.TGET(slot,slot,"_super",s->d_loc.packed());
             slotStack.push_back(slot);
-        }else if( doInline && s->d_receiver->getTag() == Thing::T_Block )
+        }else if( doInline && isInlined(s->d_receiver.data()) )
         {
             inlineBlock( static_cast<Block*>(s->d_receiver.data()));
         }else
             s->d_receiver->accept(this);
     }
 
-    void inlineIfBlock( Expression* e )
+    static inline bool isInlined( Expression* e )
+    {
+        return e->getTag() == Thing::T_Block && static_cast<Block*>(e)->d_func->d_inline;
+    }
+
+    void inlineIfBlock( Expression* e )
+    {
+        if( isInlined(e) )
+            inlineBlock( static_cast<Block*>(e));
+        else
+            e->accept(this);
+    }
+
+    QList<int> emitCondition( MsgSend* s, bool exitIfTrue )
+    {
+        return emitCondition( s->d_receiver.data(), exitIfTrue, s->d_loc );
+    }
+
+    QList<int> emitCondition( Expression* cond, bool exitIfTrue, const Loc& loc )
+    {
+        // emits the condition of an inlined if or while followed by JMPs which are taken if the body is not to be
+        // executed, i.e. if the condition is true and exitIfTrue or if the condition is false and !exitIfTrue;
+        // returns the pcs of the JMPs to be patched by the caller; the body has to follow immediately
+        QList<int> exits;
+        if( isInlined(cond) && !static_cast<Block*>(cond)->d_func->d_body.isEmpty() )
+        {
+            // only the last expression of the inlined block is the condition
+            Function* f = static_cast<Block*>(cond)->d_func.data();
+            for( int i = 0; i < f->d_body.size() - 1; i++ )
+            {
+                f->d_body[i]->accept( this );
+                ctx.sellSlots(slotStack.back());
+                slotStack.pop_back();
+            }
+            cond = f->d_body.last().data();
+        }
+
+        if( cond->getTag() == Thing::T_MsgSend )
+        {
+            MsgSend* c = static_cast<MsgSend*>(cond);
+            switch( c->d_flowControl )
+            {
+            case Not:
+                return emitCondition( c->d_receiver.data(), !exitIfTrue, c->d_loc );
+            case And:
+            case Or:
+                {
+                    // short circuit; with exitIfTrue and: only exits if both are true, or: if both are false
+                    const bool shortCircuit = c->d_flowControl == Or;
+                    if( exitIfTrue == shortCircuit )
+                    {
+                        exits = emitCondition( c->d_receiver.data(), exitIfTrue, c->d_loc );
+                        exits += emitCondition( c->d_args.first().data(), exitIfTrue, c->d_loc );
+                    }else
+                    {
+                        const QList<int> toBody = emitCondition( c->d_receiver.data(), shortCircuit, c->d_loc );
+                        exits = emitCondition( c->d_args.first().data(), exitIfTrue, c->d_loc );
+                        for( int i = 0; i < toBody.size(); i++ )
+                            bc.patch(toBody[i]);
+                    }
+                    return exits;
+                }
+            case IsNil:
+            case NotNil:
+                c->d_receiver->accept(this);
+                if( exitIfTrue == ( c->d_flowControl == IsNil ) )
+                    bc.ISEQ( slotStack.back(), QVariant(), c->d_loc.packed() );
+                else
+                    bc.ISNE( slotStack.back(), QVariant(), c->d_loc.packed() );
+                ctx.sellSlots(slotStack.back());
+                slotStack.pop_back();
+                bc.JMP(ctx.pool.d_frameSize,0,c->d_loc.packed());
+                exits << bc.getCurPc();
+                return exits;
+            default:
+                break;
+            }
+
+            if( module.d_options & LjbcCompiler2::IntegerFastPath )
+            {
+                bool primitive = false;
+                const int op = c->d_flowControl == NoFlowControl ? integerOp(c, &primitive) : int(NoIntOp);
+                if( op >= IntEq && isInteger(c->d_receiver.data()) )
+                    return emitFusedCondition( c, exitIfTrue ? op : negated(op), -1, QByteArray(), exitIfTrue );
+                QByteArray lookup;
+                const int guard = op >= IntEq ? integerGuard(c, primitive, &lookup) : -1;
+                if( guard >= 0 )
+                    return emitFusedCondition( c, exitIfTrue ? op : negated(op), guard, lookup, exitIfTrue );
+            }
+        }
+
+        inlineIfBlock(cond);
+        // the result is in slotStack.back()
+        if( exitIfTrue )
+            bc.IST(slotStack.back(),loc.packed());
+        else
+            bc.ISF(slotStack.back(),loc.packed());
+        ctx.sellSlots(slotStack.back());
+        slotStack.pop_back();
+        bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+        exits << bc.getCurPc();
+        return exits;
+    }
+
+    QList<int> emitFusedCondition( MsgSend* c, int exitOp, int guard, const QByteArray& lookup, bool exitIfTrue )
+    {
+        // like emitIntegerSend, but the comparison directly jumps instead of producing a boolean;
+        // without a guard the receiver is statically known to be an Integer and there is no slow path
+        QList<int> exits;
+        const Loc& loc = c->d_loc;
+        Expression* argExpr = c->d_args.first().data();
+
+        emitReceiver(c,false);
+        const int recv = slotStack.back();
+        argExpr->accept(this);
+        const int arg = slotStack.back();
+
+        const int tmp = ctx.buySlots(1);
+        int args = -1;
+        int slowPath = -1;
+        if( guard >= 0 )
+        {
+            args = ctx.buySlots( 3, true );
+            bc.TGET( args, recv, lookup, loc.packed() );
+            bc.UGET( tmp, guard, loc.packed() );
+            bc.ISNE( args, tmp, loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+            slowPath = bc.getCurPc();
+        }
+
+        int num = arg;
+        if( exitOp != ObjEqEq && exitOp != ObjNeNe && !isInteger(argExpr) )
+        {
+            num = tmp;
+            bc.UNM( num, arg, loc.packed() );
+            bc.UNM( num, num, loc.packed() );
+        }
+        emitIntegerCompare( exitOp, recv, num, argExpr, loc );
+        bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+        exits << bc.getCurPc();
+        if( guard < 0 )
+        {
+            ctx.sellSlots(tmp);
+            ctx.sellSlots(arg);
+            ctx.sellSlots(recv);
+            slotStack.pop_back();
+            slotStack.pop_back();
+            return exits;
+        }
+        bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+        const int body = bc.getCurPc();
+
+        bc.patch(slowPath);
+        const QByteArray method = LuaTranspiler::map(c->prettyName(false),c->d_patternType);
+        if( lookup != method )
+            bc.TGET( args, recv, method, loc.packed() );
+        bc.MOV( args+1, recv, loc.packed() );
+        bc.MOV( args+2, arg, loc.packed() );
+        bc.CALL( args, 2, 2, loc.packed() );
+        emitNonLocalReturnCheck( c, args );
+        if( exitIfTrue )
+            bc.IST(args,loc.packed());
+        else
+            bc.ISF(args,loc.packed());
+        bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+        exits << bc.getCurPc();
+
+        bc.patch(body);
+
+        ctx.sellSlots(args,3);
+        ctx.sellSlots(tmp);
+        ctx.sellSlots(arg);
+        ctx.sellSlots(recv);
+        slotStack.pop_back();
+        slotStack.pop_back();
+        return exits;
+    }
+
+    void inlineIf( MsgSend* s )
+    {
+        const QList<int> exits = emitCondition( s, s->d_flowControl == IfFalse );
+
+        Q_ASSERT( !s->d_args.isEmpty() );
+        inlineIfBlock(s->d_args.first().data());
+        // the result is in slotStack.back()
+        const int res = slotStack.back();
+
+        // before emitting the else part take care that the if part jumps over it
+        bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
+        const int label2 = bc.getCurPc();
+
+        for( int i = 0; i < exits.size(); i++ )
+            bc.patch(exits[i]);
+        if( s->d_flowControl == IfElse )
+        {
+            Q_ASSERT( s->d_args.size() == 2 );
+            inlineIfBlock(s->d_args.last().data());
+            // the result is in slotStack.back()
+            bc.MOV(res,slotStack.back(),s->d_loc.packed());
+            ctx.sellSlots(slotStack.back());
+            slotStack.pop_back();
+        }else
+            bc.KNIL(res,1,s->d_loc.packed()); // ifTrue: and ifFalse: answer nil if the block is not evaluated
+
+        bc.patch(label2);
+    }
+
+    void inlineWhile( MsgSend* s )
+    {
+        const QList<Block*> cached = cacheBlockLiterals( QList<Expression*>() << s->d_receiver.data()
+                                                         << s->d_args.first().data(), s->d_loc );
+        bc.LOOP( ctx.pool.d_frameSize, 0, s->d_loc.packed() ); // while true do
+        const quint32 startLoop = bc.getCurPc();
+        const int res = ctx.buySlots(1);
+
+        const QList<int> exits = emitCondition( s, s->d_flowControl == WhileFalse );
+
+        Q_ASSERT( !s->d_args.isEmpty() );
+        inlineIfBlock(s->d_args.first().data());
+        // the result is in slotStack.back(); it is not used
+        ctx.sellSlots(slotStack.back());
+        slotStack.pop_back();
+
+        bc.jumpToLoop( startLoop, ctx.pool.d_frameSize, s->d_loc.packed() ); // loop to start
+
+        for( int i = 0; i < exits.size(); i++ )
+            bc.patch(exits[i]);
+        bc.KNIL(res,1,s->d_loc.packed()); // whileTrue: and whileFalse: answer nil
+        releaseBlockLiterals(cached);
+
+        slotStack.push_back(res);
+    }
+
+    void inlineAndOr( MsgSend* s )
+    {
+        // and: answers false and or: answers true without evaluating the block; otherwise the block is the result
+        const bool isOr = s->d_flowControl == Or;
+        const QList<int> exits = emitCondition( s->d_receiver.data(), isOr, s->d_loc );
+
+        inlineIfBlock(s->d_args.first().data());
+        // the result is in slotStack.back()
+        const int res = slotStack.back();
+        bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
+        const int done = bc.getCurPc();
+
+        for( int i = 0; i < exits.size(); i++ )
+            bc.patch(exits[i]);
+        bc.KSET( res, isOr, s->d_loc.packed() );
+        bc.patch(done);
+    }
+
+    void inlineTest( MsgSend* s )
+    {
+        // not, isNil and notNil produce a boolean from the jumps of the condition
+        const QList<int> exits = emitCondition( s, true, s->d_loc );
+        const int res = ctx.buySlots(1);
+        slotStack.push_back(res);
+        bc.KSET( res, false, s->d_loc.packed() );
+        bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
+        const int done = bc.getCurPc();
+        for( int i = 0; i < exits.size(); i++ )
+            bc.patch(exits[i]);
+        bc.KSET( res, true, s->d_loc.packed() );
+        bc.patch(done);
+    }
+
+    void inlineIfNil( MsgSend* s )
+    {
+        // like in Object.som and Nil.som the receiver is the result if the block is not evaluated
+        emitReceiver(s,false);
+        const int res = slotStack.back();
+        if( s->d_flowControl == IfNotNil )
+            bc.ISEQ( res, QVariant(), s->d_loc.packed() );
+        else
+            bc.ISNE( res, QVariant(), s->d_loc.packed() );
+        bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
+        const int label = bc.getCurPc();
+
+        inlineIfBlock(s->d_args.first().data());
+        // the result is in slotStack.back()
+        bc.MOV(res,slotStack.back(),s->d_loc.packed());
+        ctx.sellSlots(slotStack.back());
+        slotStack.pop_back();
+
+        if( s->d_flowControl == IfNilIfNotNil )
+        {
+            bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
+            const int label2 = bc.getCurPc();
+            bc.patch(label);
+            inlineIfBlock(s->d_args.last().data());
+            // the result is in slotStack.back()
+            bc.MOV(res,slotStack.back(),s->d_loc.packed());
+            ctx.sellSlots(slotStack.back());
+            slotStack.pop_back();
+            bc.patch(label2);
+        }else
+            bc.patch(label);
+    }
+
+    void emitSend( MsgSend* s, const char* selector, quint8 res, quint8 recv, quint8 arg )
+    {
+        // regular send of a binary selector used by the inlined loops
+        const Loc& loc = s->d_loc;
+        const int args = ctx.buySlots( 3, true );
+        bc.TGET( args, recv, LuaTranspiler::map(selector,BinaryPattern), loc.packed() );
+        bc.MOV( args+1, recv, loc.packed() );
+        bc.MOV( args+2, arg, loc.packed() );
+        bc.CALL( args, 2, 2, loc.packed() );
+        emitNonLocalReturnCheck( s, args, selector );
+        bc.MOV( res, args, loc.packed() );
+        ctx.sellSlots(args,3);
+    }
+
+    void inlineLoopBody( Block* b, Variable* loopVar, quint8 val )
+    {
+        if( loopVar )
+            emitStoreVar( loopVar, val, b->d_loc );
+        inlineBlock(b);
+        // the result is in slotStack.back(); it is not used
+        ctx.sellSlots(slotStack.back());
+        slotStack.pop_back();
+    }
+
+    void inlineToDo( MsgSend* s )
+    {
+        // The loops of Integer.som (i.e. [ i <= limit ] whileTrue: [ block value: i. i := i + step ]) are inlined;
+        // if the receiver is an Integer and the step a positive integer literal a numeric for loop (FORI) is used,
+        // otherwise the loop is done with regular sends of <=, >=, + and -; as in ST80 the loop variable of the
+        // inlined block is shared by all iterations; the result is the receiver.
+        const Loc& loc = s->d_loc;
+        Block* body = static_cast<Block*>(s->d_args.last().data());
+        Q_ASSERT( body->d_func->d_inline );
+        const bool times = s->d_flowControl == TimesRepeat;
+        const bool down = s->d_flowControl == DownToDo || s->d_flowControl == DownToByDo;
+        Variable* loopVar = times ? 0 : body->d_func->d_vars.first().data();
+        Expression* limitExpr = times ? s->d_receiver.data() : s->d_args.first().data();
+        Expression* stepExpr = s->d_args.size() == 3 ? s->d_args[1].data() : 0;
+
+        const QList<Block*> cached = cacheBlockLiterals( QList<Expression*>() << body, loc );
+        emitReceiver(s,false);
+        const int recv = slotStack.back();
+        int limit = recv; // timesRepeat: counts from 1 to the receiver
+        if( !times )
+        {
+            limitExpr->accept(this);
+            limit = slotStack.back();
+        }
+        int step = -1;
+        if( stepExpr )
+        {
+            stepExpr->accept(this);
+            step = slotStack.back();
+        }
+
+        // FORI counts down with a negative step, but the loops of Integer.som would never terminate in that case
+        qint64 inc = 1;
+        bool fast = ( module.d_options & LjbcCompiler2::IntegerFastPath ) && genericLoops == 0;
+        if( stepExpr )
+        {
+            if( isIntLiteral(stepExpr) )
+                inc = static_cast<Number*>(stepExpr)->toNumber().toLongLong();
+            fast = fast && isIntLiteral(stepExpr) && inc > 0;
+        }
+        int guard = -1;
+        QByteArray lookup;
+        if( fast && !isInteger(s->d_receiver.data()) )
+        {
+            // the receiver is an Integer if it has the < primitive of class Integer
+            guard = integerGuard(s, false, &lookup);
+            fast = guard >= 0;
+        }
+
+        int slowPath = -1;
+        if( guard >= 0 )
+        {
+            const int tmp = ctx.buySlots(2);
+            bc.TGET( tmp, recv, lookup, loc.packed() );
+            bc.UGET( tmp+1, guard, loc.packed() );
+            bc.ISNE( tmp, tmp+1, loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+            slowPath = bc.getCurPc();
+            ctx.sellSlots(tmp,2);
+        }
+
+        int done = -1;
+        if( fast )
+        {
+            // base: start, base+1: limit, base+2: step, base+3: visible loop variable
+            const int base = ctx.buySlots(4);
+            if( times )
+                bc.KSET( base, 1, loc.packed() );
+            else
+                bc.MOV( base, recv, loc.packed() );
+            if( isIntLiteral(limitExpr) )
+                bc.KSET( base+1, static_cast<Number*>(limitExpr)->toNumber(), loc.packed() );
+            else if( isInteger(limitExpr) )
+                bc.MOV( base+1, limit, loc.packed() );
+            else
+            {
+                // the limit is coerced like in the primitives by -(-arg)
+                bc.UNM( base+1, limit, loc.packed() );
+                bc.UNM( base+1, base+1, loc.packed() );
+            }
+            bc.KSET( base+2, down ? -inc : inc, loc.packed() );
+            bc.FORI( base, 0, loc.packed() );
+            const int fori = bc.getCurPc();
+            FindAssig f(loopVar);
+            if( loopVar )
+                body->accept(&f);
+            if( loopVar && !f.found )
+                intVars << loopVar; // start and step are Integers, so all values of the loop variable are
+            inlineLoopBody( body, loopVar, base+3 );
+            intVars.remove(loopVar);
+            bc.FORL( base, fori - bc.getCurPc() - 1, loc.packed() );
+            bc.patch(fori);
+            ctx.sellSlots(base,4);
+            if( slowPath >= 0 )
+            {
+                bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+                done = bc.getCurPc();
+                bc.patch(slowPath);
+            }
+        }
+
+        if( !fast || slowPath >= 0 )
+        {
+            // nested loops in the body only use the generic loop to avoid emitting their bodies over and over again
+            genericLoops++;
+            const int i = ctx.buySlots(1);
+            const int tmp = ctx.buySlots(1);
+            if( times )
+                bc.KSET( i, 1, loc.packed() );
+            else
+                bc.MOV( i, recv, loc.packed() );
+            bc.LOOP( ctx.pool.d_frameSize, 0, loc.packed() ); // while true do
+            const quint32 startLoop = bc.getCurPc();
+            emitSend( s, down ? ">=" : "<=", tmp, i, limit );
+            bc.ISF( tmp, loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+            const int exit = bc.getCurPc();
+            inlineLoopBody( body, loopVar, i );
+            if( step < 0 )
+                bc.KSET( tmp, 1, loc.packed() );
+            emitSend( s, down ? "-" : "+", i, i, step < 0 ? tmp : step );
+            bc.jumpToLoop( startLoop, ctx.pool.d_frameSize, loc.packed() ); // loop to start
+            bc.patch(exit);
+            ctx.sellSlots(tmp);
+            ctx.sellSlots(i);
+            genericLoops--;
+        }
+        if( done >= 0 )
+            bc.patch(done);
+
+        if( step >= 0 )
+        {
+            ctx.sellSlots(step);
+            slotStack.pop_back();
+        }
+        if( !times )
+        {
+            ctx.sellSlots(limit);
+            slotStack.pop_back();
+        }
+        releaseBlockLiterals(cached);
+        // the receiver is still in slotStack.back() and is the result of the loop
+    }
+
+    static inline QString printLoc(const Loc& loc )
+    {
+        return QString("%1:%2:%3").arg(QFileInfo(loc.d_source).baseName()).arg(loc.d_line).arg(loc.d_col);
+    }
+
+    virtual void visit( MsgSend* s )
+    {
+        switch( s->d_flowControl )
+        {
+        case IfTrue:
+        case IfFalse:
+        case IfElse:
+            inlineIf(s);
+            return;
+        case WhileTrue:
+        case WhileFalse:
+            inlineWhile(s);
+            return;
+        case And:
+        case Or:
+            inlineAndOr(s);
+            return;
+        case Not:
+        case IsNil:
+        case NotNil:
+            inlineTest(s);
+            return;
+        case IfNil:
+        case IfNotNil:
+        case IfNilIfNotNil:
+            inlineIfNil(s);
+            return;
+        case ToDo:
+        case ToByDo:
+        case DownToDo:
+        case DownToByDo:
+        case TimesRepeat:
+            inlineToDo(s);
+            return;
+        }
+
+        if( ( module.d_options & LjbcCompiler2::IntegerFastPath ) && emitIntegerSend(s) )
+            return;
+
+        if( ( module.d_options & LjbcCompiler2::InlineMethods ) && inlineSend(s) )
+            return;
+
+        const int direct = boundMethod(s);
+        const bool super = s->d_receiver->keyword() == Expression::_super;
+        // the slots to restore the reused blocks must be below the call frame which is overwritten by the call
+        const QList<Block*> reused = reuseBlocks(s);
+        // the receiver and the arguments are evaluated into the call frame, see emitTo
+        const int args = ctx.buySlots( s->d_args.size() + 2, true );
+        if( super )
+        {
+            if( direct < 0 )
+            {
+                emitReceiver(s,false); // the superclass is not needed if the method is known
+                // the result is in slotStack.back()
+                bc.TGET( args, slotStack.back(),
+                     LuaTranspiler::map(s->prettyName(false),s->d_patternType), s->d_loc.packed() );
+                ctx.sellSlots(slotStack.back());
+                slotStack.pop_back();
+            }
+            bool toSell = false;
+            int _self = selfToSlot( &toSell, s->d_loc );
+            bc.MOV( args+1, _self, s->d_loc.packed() ); // use self for calls to super
+            if( toSell )
+                ctx.sellSlots(_self);
+        }else
+        {
+            emitTo( s->d_receiver.data(), args+1, s->d_loc );
+            if( direct < 0 )
+                bc.TGET( args, args+1,
+                     LuaTranspiler::map(s->prettyName(false),s->d_patternType), s->d_loc.packed() );
+        }
+        if( direct >= 0 )
+            bc.UGET( args, direct, s->d_loc.packed() ); // no lookup needed; see LjObjectManager::bindSends
+        for( int i = 0; i < s->d_args.size(); i++ )
+            emitTo( s->d_args[i].data(), args+2+i, s->d_loc );
+        if( s == tailSend && reused.isEmpty() )
+        {
+            // all results of the callee, including a passing non-local return, are the results of this function
+            bc.CALLT(args,s->d_args.size() + 1, s->d_loc.packed() );
+            tailCalled = true;
+            const int res = ctx.buySlots(1);
+            slotStack.push_back(res);
+            ctx.sellSlots(args, s->d_args.size() + 2);
+        }else
+        {
+            bc.CALL(args,2,s->d_args.size() + 1, s->d_loc.packed() );
+
+            restoreBlocks( reused, s->d_loc );
+            emitNonLocalReturnCheck( s, args );
+
+            // otherwise the return value stays where it is as the expression result
+            slotStack.push_back(args);
+            ctx.sellSlots(args + 1, s->d_args.size() + 1);
+        }
+    }
+
+    QList<Block*> reuseBlocks( MsgSend* s )
+    {
+        // the block literals which the callee doesn't keep use the instance created by the module function,
+        // see LjObjectManager::findReusedBlocks; block literals in loops are instantiated only once anyway
+        QList<Block*> res;
+        if( !( module.d_options & LjbcCompiler2::ReuseBlocks ) )
+            return res;
+        for( int i = 0; i < s->d_args.size(); i++ )
+        {
+            if( s->d_args[i]->getTag() != Thing::T_Block )
+                continue;
+            Block* b = static_cast<Block*>( s->d_args[i].data() );
+            if( !module.d_reused.contains(b) || blockCache.contains(b) )
+                continue;
+            reusing[b] = ctx.buySlots( b->d_func->d_inlinedLevel );
+            res << b;
+        }
+        return res;
+    }
+
+    void reuseBlock( Block* b, quint8 inst )
+    {
+        // the instance gets the param tables of this activation; the ones it had before (i.e. of an activation
+        // further up the stack which passed it too) are saved and restored after the call
+        const Loc& loc = b->d_loc;
+        const int saved = reusing.value(b);
+        bc.UGET( inst, ctx.getUpvalNr(b->d_func.data()), loc.packed() );
+        const int n = b->d_func->d_inlinedLevel;
+        const int tmp = ctx.buySlots(1);
+        for( int i = 0; i < n; i++ )
+        {
+            bc.TGETi( saved + i, inst, i, loc.packed() );
+            if( i == n - 1 )
+            {
+                if( ctx.paramTable >= 0 )
+                    bc.TSETi( ctx.paramTable, inst, i, loc.packed() );
+            }else
+            {
+                // see visit(Block)
+                QHash<int,quint8>::const_iterator j = outerTables.find(i);
+                if( j != outerTables.end() )
+                    bc.TSETi( j.value(), inst, i, loc.packed() );
+                else
+                {
+                    bc.TGETi( tmp, 0, i, loc.packed() );
+                    bc.TSETi( tmp, inst, i, loc.packed() );
+                }
+            }
+        }
+        ctx.sellSlots(tmp);
+    }
+
+    void restoreBlocks( const QList<Block*>& blocks, const Loc& loc )
+    {
+        for( int i = 0; i < blocks.size(); i++ )
+        {
+            Block* b = blocks[i];
+            const int saved = reusing.take(b);
+            const int n = b->d_func->d_inlinedLevel;
+            const int inst = ctx.buySlots(1);
+            bc.UGET( inst, ctx.getUpvalNr(b->d_func.data()), loc.packed() );
+            for( int j = 0; j < n; j++ )
+                bc.TSETi( saved + j, inst, j, loc.packed() );
+            ctx.sellSlots(inst);
+            ctx.sellSlots(saved, n);
+        }
+    }
+
+    void emitTo( Expression* e, quint8 to, const Loc& loc )
+    {
+        // leaves are directly evaluated into slot to instead of a temporary which is then copied
+        if( e->getTag() == Thing::T_Ident || e->getTag() == Thing::T_Number )
+            dest = to;
+        e->accept(this);
+        Q_ASSERT( dest < 0 );
+        // the result is in slotStack.back()
+        if( slotStack.back() != to )
+        {
+            bc.MOV( to, slotStack.back(), loc.packed() );
+            ctx.sellSlots(slotStack.back());
+        }
+        slotStack.pop_back();
+    }
+
+    int resultSlot()
+    {
+        // the slot requested by emitTo or a new temporary
+        if( dest >= 0 )
+        {
+            const int res = dest;
+            dest = -1;
+            return res;
+        }
+        return ctx.buySlots(1);
+    }
+
+    bool canTailCall( Expression* e, bool nonLocal ) const
+    {
+        // a send in return position can be a tail call if the function doesn't have to check for a non-local
+        // return targeting it; blocks pass all non-local returns through
+        if( !( module.d_options & LjbcCompiler2::TailCalls ) || inl != 0 || nonLocal ||
+                e->getTag() != Thing::T_MsgSend )
+            return false;
+        MsgSend* s = static_cast<MsgSend*>(e);
+        if( block || !owningMethod()->d_hasNonLocalReturnIfInlined )
+            return true;
+        return module.d_nlrSelectors && !module.d_nlrSelectors->contains( s->prettyName(false) );
+    }
+
+    bool inlineSend( MsgSend* s )
+    {
+        // the body of a small method is compiled in place of the send with self and the params bound to the slots of
+        // the receiver and the arguments; if the method is not statically known the method looked up in the receiver
+        // is compared with it and a regular send is done if they are not identical
+        LjbcCompiler2::Module::Inlines::const_iterator it = module.d_inlines.find(s);
+        if( it == module.d_inlines.end() || inl != 0 )
+            return false;
+        Method* callee = it.value().d_callee;
+        int guard = -1;
+        if( !it.value().d_guard.isEmpty() )
+        {
+            const int slot = module.getConst(it.value().d_guard);
+            if( slot < 0 )
+                return false;
+            guard = ctx.getUpvalNr(slot);
+        }
+        const Loc& loc = s->d_loc;
+
+        emitReceiver(s,false);
+        Inlining i;
+        i.callee = callee;
+        i.self = slotStack.back();
+        for( int j = 0; j < s->d_args.size(); j++ )
+        {
+            s->d_args[j]->accept(this);
+            i.args << slotStack.back();
+        }
+
+        const int res = ctx.buySlots(1);
+        const int args = ctx.buySlots( s->d_args.size() + 2, true );
+        int slowPath = -1;
+        if( guard >= 0 )
+        {
+            bc.TGET( args, i.self, LuaTranspiler::map(s->prettyName(false),s->d_patternType), loc.packed() );
+            bc.UGET( res, guard, loc.packed() );
+            bc.ISNE( args, res, loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+            slowPath = bc.getCurPc();
+        }
+
+        // see LjObjectManager::bindSends for the kind of bodies which can be inlined
+        Q_ASSERT( callee->d_body.size() <= 1 );
+        if( callee->d_body.isEmpty() )
+            bc.MOV( res, i.self, loc.packed() );
+        else
+        {
+            inl = &i;
+            Expression* e = callee->d_body.first().data();
+            const bool ret = e->getTag() == Thing::T_Return;
+            if( ret )
+                e = static_cast<Return*>(e)->d_what.data();
+            e->accept(this);
+            inl = 0;
+            // methods without return answer self
+            bc.MOV( res, ret ? slotStack.back() : i.self, loc.packed() );
+            ctx.sellSlots(slotStack.back());
+            slotStack.pop_back();
+        }
+
+        if( slowPath >= 0 )
+        {
+            bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+            const int done = bc.getCurPc();
+            bc.patch(slowPath);
+            bc.MOV( args+1, i.self, loc.packed() );
+            for( int j = 0; j < i.args.size(); j++ )
+                bc.MOV( args+2+j, i.args[j], loc.packed() );
+            bc.CALL( args, 2, s->d_args.size() + 1, loc.packed() );
+            emitNonLocalReturnCheck( s, args );
+            bc.MOV( res, args, loc.packed() );
+            bc.patch(done);
+        }
+
+        ctx.sellSlots( args, s->d_args.size() + 2 );
+        for( int j = 0; j < i.args.size(); j++ )
+        {
+            ctx.sellSlots(slotStack.back());
+            slotStack.pop_back();
+        }
+        ctx.sellSlots(i.self);
+        slotStack.pop_back();
+        slotStack.push_back(res);
+        return true;
+    }
+
+    int boundMethod( MsgSend* s )
+    {
+        // upvalue of the method called by a monomorphic send or super send, or -1
+        if( !( module.d_options & LjbcCompiler2::Devirtualize ) && s->d_receiver->keyword() != Expression::_super )
+            return -1;
+        LjbcCompiler2::Module::Bound::const_iterator i = module.d_bound.find(s);
+        if( i == module.d_bound.end() )
+            return -1;
+        const int slot = module.getConst(i.value());
+        if( slot < 0 )
+            return -1;
+        return ctx.getUpvalNr(slot);
+    }
+
+    void emitNonLocalReturnCheck( MsgSend* s, int args, const QByteArray& selector = QByteArray() )
+    {
+        if( module.d_nlrSelectors &&
+                !module.d_nlrSelectors->contains( selector.isEmpty() ? s->prettyName(false) : selector ) )
+            return; // no method understanding the selector ever passes through a non-local return
+
+        if( block || !owningMethod()->d_hasNonLocalReturnIfInlined ) // s can be in an inlined method
+        {
+            // if there is a second return value which is not nil we directly return from blocks
+            // and methods where no local return block was defined and just pass through the second value
+            bc.ISF( args+1, s->d_loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,1, s->d_loc.packed() );
+            const int label = bc.getCurPc();
+            bc.RET(args, 2,s->d_loc.packed());
+            bc.patch( label );
+        }else // if not in block and owningMethod()->d_hasNonLocalReturn
+        {
+            // here we are on method level; check whether it is the method in which the no local return was defined.
+            bc.ISF( args+1, s->d_loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,0, s->d_loc.packed() );
+            const int label = bc.getCurPc();
+            Q_ASSERT( owningMethod()->d_nlrToken != 0 );
+            bc.ISEQ( args+1, QVariant(int(owningMethod()->d_nlrToken)), s->d_loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,1, s->d_loc.packed() );
+            const int label2 = bc.getCurPc();
+            bc.RET(args, 2,s->d_loc.packed()); // return with second argument, because this is not the method where
+                                               // the non-local return was defined in
+            bc.patch( label2 );
+            bc.RET(args, 1,s->d_loc.packed()); // return with no second argument
+            bc.patch(label);
+        }
+    }
+
+    enum IntegerOp { NoIntOp, IntAdd, IntSub, IntMul, IntMod,
+                     IntEq, IntNe, IntLt, IntLe, IntGt, IntGe, ObjEqEq, ObjNeNe }; // comparisons start with IntEq
+
+    static int negated( int op )
+    {
+        switch( op )
+        {
+        case IntEq:
+            return IntNe;
+        case IntNe:
+            return IntEq;
+        case IntLt:
+            return IntGe;
+        case IntGe:
+            return IntLt;
+        case IntLe:
+            return IntGt;
+        case IntGt:
+            return IntLe;
+        case ObjEqEq:
+            return ObjNeNe;
+        case ObjNeNe:
+            return ObjEqEq;
+        default:
+            Q_ASSERT( false );
+            return NoIntOp;
+        }
+    }
+
+    static int integerOp( MsgSend* s, bool* primitive )
+    {
+        // the semantics of the SOM implemented ones correspond to Integer.som, e.g. >= is (self < arg) not;
+        // LuaJIT's ISGE is "not ISLT" and ISGT is "not ISLE", so also NaN arguments yield the same results
+        static const struct { const char* sel; int op; bool prim; } ops[] = {
+            { "+", IntAdd, true }, { "-", IntSub, true }, { "*", IntMul, true }, { "%", IntMod, true },
+            { "=", IntEq, true }, { "<", IntLt, true },
+            { "~=", IntNe, false }, { "<>", IntNe, false }, { "<=", IntLe, false }, { ">", IntGt, false },
+            { ">=", IntGe, false }, { "==", ObjEqEq, true }, { 0, NoIntOp, false } };
+        if( s->d_patternType != BinaryPattern || s->d_args.size() != 1 ||
+                s->d_receiver->keyword() == Expression::_super )
+            return NoIntOp;
+        const QByteArray sel = s->prettyName(false);
+        for( int i = 0; ops[i].sel != 0; i++ )
+        {
+            if( sel == ops[i].sel )
+            {
+                *primitive = ops[i].prim;
+                return ops[i].op;
+            }
+        }
+        return NoIntOp;
+    }
+
+    int integerGuard( MsgSend* s, bool primitive, QByteArray* lookup )
+    {
+        // the primitive of class Integer with which the method looked up in the receiver is compared; the methods of
+        // Integer.som don't exist yet when the core classes loaded before Integer run, but the primitives do, and a
+        // receiver which has the < or = of Integer is an Integer, so the others can be assumed as well
+        QByteArray sel = s->prettyName(false);
+        QByteArrayList path;
+        if( sel == "==" )
+            path << "_primitives" << "Object" << sel; // identity, i.e. rawequal, if not overridden
+        else
+        {
+            if( !primitive )
+                sel = sel == "~=" || sel == "<>" ? "=" : "<";
+            path << "_primitives" << "Integer" << sel;
+        }
+        *lookup = LuaTranspiler::map(sel,BinaryPattern);
+        const int slot = module.getConst(path);
+        if( slot < 0 )
+            return -1;
+        return ctx.getUpvalNr(slot);
+    }
+
+    static inline bool isIntLiteral( Expression* e )
+    {
+        return e->getTag() == Thing::T_Number && !static_cast<Number*>(e)->d_real;
+    }
+
+    bool isInteger( Expression* e )
+    {
+        // the value of e is statically known to be an Integer (i.e. a Lua number), so sends of the selectors of
+        // integerOp need neither a guard nor a slow path; this requires that these are the methods of Integer.som
+        if( !module.d_integerPrimitives || !( module.d_options & LjbcCompiler2::IntegerFastPath ) )
+            return false;
+        switch( e->getTag() )
+        {
+        case Thing::T_Number:
+            return !static_cast<Number*>(e)->d_real;
+        case Thing::T_Ident:
+            {
+                Ident* id = static_cast<Ident*>(e);
+                return id->d_resolved && id->d_resolved->getTag() == Thing::T_Variable &&
+                        intVars.contains( static_cast<Variable*>(id->d_resolved) );
+            }
+        case Thing::T_MsgSend:
+            {
+                // the result of the inlined arithmetic is a Lua number
+                MsgSend* s = static_cast<MsgSend*>(e);
+                bool primitive = false;
+                const int op = s->d_flowControl == NoFlowControl ? integerOp(s, &primitive) : int(NoIntOp);
+                return op >= IntAdd && op <= IntMod && isInteger(s->d_receiver.data());
+            }
+        default:
+            return false;
+        }
+    }
+
+    bool constInteger( Expression* e, double* val )
     {
-        if( e->getTag() == Thing::T_Block )
-            inlineBlock( static_cast<Block*>(e));
-        else
-            e->accept(this);
+        if( !isInteger(e) )
+            return false;
+        if( e->getTag() == Thing::T_Number )
+        {
+            *val = static_cast<Number*>(e)->toNumber().toDouble();
+            return true;
+        }
+        QVariant v;
+        if( e->getTag() == Thing::T_MsgSend && foldInteger( static_cast<MsgSend*>(e), &v ) &&
+                v.type() != QVariant::Bool )
+        {
+            *val = v.toDouble();
+            return true;
+        }
+        return false;
     }
 
-    void inlineIf( MsgSend* s )
+    bool foldInteger( MsgSend* s, QVariant* res )
     {
-        emitReceiver(s);
-        // the result is in slotStack.back()
-        switch( s->d_flowControl )
+        // sends of the selectors of integerOp with constant Integer operands are evaluated by the compiler
+        bool primitive = false;
+        const int op = integerOp(s, &primitive);
+        double lhs, rhs, r = 0;
+        if( op == NoIntOp || !constInteger( s->d_receiver.data(), &lhs ) ||
+                !constInteger( s->d_args.first().data(), &rhs ) )
+            return false;
+        switch( op )
         {
-        case IfTrue:
-        case IfElse:
-            bc.ISF(slotStack.back(),s->d_loc.packed());
+        case IntAdd:
+            r = lhs + rhs;
             break;
-        case IfFalse:
-            bc.IST(slotStack.back(),s->d_loc.packed());
+        case IntSub:
+            r = lhs - rhs;
             break;
-        default:
-            Q_ASSERT(false);
+        case IntMul:
+            r = lhs * rhs;
+            break;
+        case IntMod:
+            if( rhs == 0 )
+                return false;
+            r = lhs - ::floor( lhs / rhs ) * rhs; // like the Lua % operator
             break;
+        case IntEq:
+        case ObjEqEq:
+            *res = lhs == rhs;
+            return true;
+        case IntNe:
+            *res = lhs != rhs;
+            return true;
+        case IntLt:
+            *res = lhs < rhs;
+            return true;
+        case IntLe:
+            *res = lhs <= rhs;
+            return true;
+        case IntGt:
+            *res = lhs > rhs;
+            return true;
+        case IntGe:
+            *res = lhs >= rhs;
+            return true;
+        default:
+            return false;
         }
-        ctx.sellSlots(slotStack.back());
-        slotStack.pop_back();
-        bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
-        const int label = bc.getCurPc();
-
-        Q_ASSERT( !s->d_args.isEmpty() );
-        inlineIfBlock(s->d_args.first().data());
-        // the result is in slotStack.back()
-
-        if( s->d_flowControl == IfElse )
-        {
-            // before emitting the else part take care that the if part jumps over it
-            bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
-            const int label2 = bc.getCurPc();
-
-            bc.patch(label);
-            const int res = slotStack.back();
-            Q_ASSERT( s->d_args.size() == 2 );
-            inlineIfBlock(s->d_args.last().data());
-            // the result is in slotStack.back()
-            bc.MOV(res,slotStack.back(),s->d_loc.packed());
-            ctx.sellSlots(slotStack.back());
-            slotStack.pop_back();
-
-            bc.patch(label2);
-        }else
-            bc.patch(label);
-
+        if( r >= -2147483648.0 && r <= 2147483647.0 && r == ::floor(r) )
+            *res = int(r);
+        else
+            *res = r;
+        return true;
     }
 
-    void inlineWhile( MsgSend* s )
+    void emitIntegerOp( int op, quint8 res, quint8 lhs, quint8 rhs, Expression* rhsExpr, const Loc& loc )
     {
-        bc.LOOP( ctx.pool.d_frameSize, 0, s->d_loc.packed() ); // while true do
-        const quint32 startLoop = bc.getCurPc();
-        const int res = ctx.buySlots(1);
-
-        emitReceiver(s);
-        // the result is in slotStack.back()
-        switch( s->d_flowControl )
+        // rhs is already coerced to a number
+        const bool lit = isIntLiteral(rhsExpr);
+        switch( op )
         {
-        case WhileTrue:
-            bc.ISF(slotStack.back(),s->d_loc.packed());
+        case IntAdd:
+            if( lit )
+                bc.ADD( res, lhs, static_cast<Number*>(rhsExpr)->toNumber(), loc.packed() );
+            else
+                bc.ADD( res, lhs, rhs, loc.packed() );
             break;
-        case WhileFalse:
-            bc.IST(slotStack.back(),s->d_loc.packed());
+        case IntSub:
+            if( lit )
+                bc.SUB( res, lhs, static_cast<Number*>(rhsExpr)->toNumber(), loc.packed() );
+            else
+                bc.SUB( res, lhs, rhs, loc.packed() );
+            break;
+        case IntMul:
+            if( lit )
+                bc.MUL( res, lhs, static_cast<Number*>(rhsExpr)->toNumber(), loc.packed() );
+            else
+                bc.MUL( res, lhs, rhs, loc.packed() );
+            break;
+        case IntMod:
+            if( lit )
+                bc.MOD( res, lhs, static_cast<Number*>(rhsExpr)->toNumber(), loc.packed() );
+            else
+                bc.MOD( res, lhs, rhs, loc.packed() );
             break;
         default:
-            Q_ASSERT(false);
+            {
+                // comparison; the following JMP is taken if the comparison is true
+                emitIntegerCompare( op, lhs, rhs, rhsExpr, loc );
+                bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+                const int isTrue = bc.getCurPc();
+                bc.KSET( res, false, loc.packed() );
+                bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+                const int done = bc.getCurPc();
+                bc.patch(isTrue);
+                bc.KSET( res, true, loc.packed() );
+                bc.patch(done);
+            }
             break;
         }
-        ctx.sellSlots(slotStack.back());
-        slotStack.pop_back();
-        bc.JMP(ctx.pool.d_frameSize,0,s->d_loc.packed());
-        const int label = bc.getCurPc();
-
-        Q_ASSERT( !s->d_args.isEmpty() );
-        inlineIfBlock(s->d_args.first().data());
-        // the result is in slotStack.back()
-        bc.MOV( res, slotStack.back(), s->d_loc.packed());
-        ctx.sellSlots(slotStack.back());
-        slotStack.pop_back();
-
-        bc.jumpToLoop( startLoop, ctx.pool.d_frameSize, s->d_loc.packed() ); // loop to start
-
-        bc.patch( label );
-
-        slotStack.push_back(res);
     }
 
-    static inline QString printLoc(const Loc& loc )
+    static QVariant constValueOf( Expression* e, bool* ok )
     {
-        return QString("%1:%2:%3").arg(QFileInfo(loc.d_source).baseName()).arg(loc.d_line).arg(loc.d_col);
+        // ISEQ and ISNE have variants with constant integers and primitives (nil, true, false)
+        *ok = true;
+        if( isIntLiteral(e) )
+            return static_cast<Number*>(e)->toNumber();
+        switch( e->keyword() )
+        {
+        case Expression::_nil:
+            return QVariant();
+        case Expression::_true:
+            return true;
+        case Expression::_false:
+            return false;
+        default:
+            break;
+        }
+        *ok = false;
+        return QVariant();
     }
 
-    virtual void visit( MsgSend* s )
+    void emitIntegerCompare( int op, quint8 lhs, quint8 rhs, Expression* rhsExpr, const Loc& loc )
     {
-        switch( s->d_flowControl )
+        bool isConst = false;
+        const QVariant c = constValueOf(rhsExpr, &isConst);
+        if( ( op == IntEq || op == IntNe ) && rhsExpr->keyword() != Expression::None )
+            isConst = false; // Integer = compares with -(-arg), which is never nil, true or false
+        switch( op )
         {
-        case IfTrue:
-        case IfFalse:
-        case IfElse:
-            inlineIf(s);
-            return;
-        case WhileTrue:
-        case WhileFalse:
-            inlineWhile(s);
-            return;
+        case IntEq:
+        case ObjEqEq:
+            if( isConst )
+                bc.ISEQ( lhs, c, loc.packed() );
+            else
+                bc.ISEQ( lhs, rhs, loc.packed() );
+            break;
+        case IntNe:
+        case ObjNeNe:
+            if( isConst )
+                bc.ISNE( lhs, c, loc.packed() );
+            else
+                bc.ISNE( lhs, rhs, loc.packed() );
+            break;
+        case IntLt:
+            bc.ISLT( lhs, rhs, loc.packed() );
+            break;
+        case IntLe:
+            bc.ISLE( lhs, rhs, loc.packed() );
+            break;
+        case IntGt:
+            bc.ISGT( lhs, rhs, loc.packed() );
+            break;
+        case IntGe:
+            bc.ISGE( lhs, rhs, loc.packed() );
+            break;
+        default:
+            Q_ASSERT( false );
+            break;
         }
+    }
 
-        emitReceiver(s,false);
-        // the result is in slotStack.back()
-        const int args = ctx.buySlots( s->d_args.size() + 2, true );
-        bc.TGET( args, slotStack.back(),
-                 LuaTranspiler::map(s->prettyName(false),s->d_patternType), s->d_loc.packed() );
-        if( s->d_receiver->keyword() == Expression::_super )
+    bool emitIntegerSend( MsgSend* s )
+    {
+        // LuaJIT 2.0 has no bytecode to check the type of a value; instead we compare the method looked up for the
+        // selector (which is required for the regular send anyway) with the one of class Integer; if they are
+        // identical the receiver is a Lua number and the primitive can be inlined; otherwise a regular send is done.
+        bool primitive = false;
+        const int op = integerOp(s, &primitive);
+        if( op == NoIntOp )
+            return false;
+        const Loc& loc = s->d_loc;
+        Expression* argExpr = s->d_args.first().data();
+
+        QVariant folded;
+        if( foldInteger( s, &folded ) )
         {
-            int _self = selfToSlot( s->d_loc );
-            bc.MOV( args+1, _self, s->d_loc.packed() ); // use self for calls to super
-            ctx.sellSlots(_self);
-        }else
-            bc.MOV( args+1, slotStack.back(), s->d_loc.packed() );
-        ctx.sellSlots(slotStack.back());
-        slotStack.pop_back();
-        for( int i = 0; i < s->d_args.size(); i++ )
+            const int res = ctx.buySlots(1);
+            slotStack.push_back(res);
+            bc.KSET( res, folded, loc.packed() );
+            return true;
+        }
+        if( isInteger(s->d_receiver.data()) )
         {
-            s->d_args[i]->accept(this);
-            // the result is in slotStack.back()
-            bc.MOV(args+2+i, slotStack.back(), s->d_loc.packed() );
-            ctx.sellSlots(slotStack.back());
+            // no guard and no slow path needed
+            emitReceiver(s,false);
+            const int recv = slotStack.back();
+            argExpr->accept(this);
+            const int arg = slotStack.back();
+            const int res = ctx.buySlots(1);
+            int num = arg;
+            if( op != ObjEqEq && !isInteger(argExpr) )
+            {
+                num = ctx.buySlots(1);
+                bc.UNM( num, arg, loc.packed() );
+                bc.UNM( num, num, loc.packed() );
+            }
+            emitIntegerOp( op, res, recv, num, argExpr, loc );
+            if( num != arg )
+                ctx.sellSlots(num);
+            ctx.sellSlots(arg);
+            ctx.sellSlots(recv);
+            slotStack.pop_back();
             slotStack.pop_back();
+            slotStack.push_back(res);
+            return true;
         }
-        bc.CALL(args,2,s->d_args.size() + 1, s->d_loc.packed() );
 
-        if( block || !s->d_inMethod->d_hasNonLocalReturnIfInlined )
-        {
-            // if there is a second return value which is not nil we directly return from blocks
-            // and methods where no local return block was defined and just pass through the second value
-            bc.ISF( args+1, s->d_loc.packed() );
-            bc.JMP(ctx.pool.d_frameSize,1, s->d_loc.packed() );
-            const int label = bc.getCurPc();
-            bc.RET(args, 2,s->d_loc.packed());
-            bc.patch( label );
-        }else // if not in block and s->d_inMethod->d_hasNonLocalReturn
+        QByteArray lookup;
+        const int guard = integerGuard(s, primitive, &lookup);
+        if( guard < 0 )
+            return false;
+
+        emitReceiver(s,false);
+        const int recv = slotStack.back();
+        argExpr->accept(this);
+        const int arg = slotStack.back();
+
+        const int res = ctx.buySlots(1);
+        const int args = ctx.buySlots( 3, true );
+        bc.TGET( args, recv, lookup, loc.packed() );
+        bc.UGET( res, guard, loc.packed() );
+        bc.ISNE( args, res, loc.packed() );
+        bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+        const int slowPath = bc.getCurPc();
+
+        // fast path; the argument is coerced like in the primitives by -(-arg)
+        int num = arg;
+        if( op != ObjEqEq && !isInteger(argExpr) )
         {
-            // here we are on method level; check whether it is the method in which the no local return was defined.
-            bc.ISF( args+1, s->d_loc.packed() );
-            bc.JMP(ctx.pool.d_frameSize,0, s->d_loc.packed() );
-            const int label = bc.getCurPc();
-            const int tmp = ctx.buySlots(1);
-            bc.KSET( tmp, (ptrdiff_t)owningMethod(), s->d_loc.packed() );
-            bc.ISEQ( args+1, tmp, s->d_loc.packed() );
-            bc.JMP(ctx.pool.d_frameSize,1, s->d_loc.packed() );
-            const int label2 = bc.getCurPc();
-            bc.RET(args, 2,s->d_loc.packed()); // return with second argument, because this is not the method where
-                                               // the non-local return was defined in
-            bc.patch( label2 );
-            bc.RET(args, 1,s->d_loc.packed()); // return with no second argument
-            bc.patch(label);
+            num = ctx.buySlots(1);
+            bc.UNM( num, arg, loc.packed() );
+            bc.UNM( num, num, loc.packed() );
         }
+        emitIntegerOp( op, res, recv, num, argExpr, loc );
+        if( num != arg )
+            ctx.sellSlots(num);
+        bc.JMP(ctx.pool.d_frameSize,0,loc.packed());
+        const int done = bc.getCurPc();
+
+        // slow path
+        bc.patch(slowPath);
+        const QByteArray method = LuaTranspiler::map(s->prettyName(false),s->d_patternType);
+        if( lookup != method )
+            bc.TGET( args, recv, method, loc.packed() );
+        bc.MOV( args+1, recv, loc.packed() );
+        bc.MOV( args+2, arg, loc.packed() );
+        bc.CALL( args, 2, 2, loc.packed() );
+        emitNonLocalReturnCheck( s, args );
+        bc.MOV( res, args, loc.packed() );
+        bc.patch(done);
 
-        // otherwise just use the return value as the expression result
-        const int res = ctx.buySlots(1);
+        ctx.sellSlots(args,3);
+        ctx.sellSlots(arg);
+        ctx.sellSlots(recv);
+        slotStack.pop_back();
+        slotStack.pop_back();
         slotStack.push_back(res);
-        bc.MOV(res,args,s->d_loc.packed());
-        ctx.sellSlots(args, s->d_args.size() + 2);
+        return true;
     }
 
     virtual void visit( Return* r )
     {
+        MsgSend* outer = tailSend;
+        tailSend = canTailCall( r->d_what.data(), block && r->d_nonLocalIfInlined ) ?
+                    static_cast<MsgSend*>( r->d_what.data() ) : 0;
         r->d_what->accept(this);
+        tailSend = outer;
         // the result is in slotStack.back()
-        if( block && r->d_nonLocalIfInlined )
+        if( tailCalled )
+            tailCalled = false; // the function already returned with the results of the callee
+        else if( block && r->d_nonLocalIfInlined )
         {
             // Block Level
             // an explicit return in a block is always a non-local return
             const int slot = ctx.buySlots(2);
             bc.MOV(slot,slotStack.back(),r->d_loc.packed());
-            // use the AST address of the Method as id (RISK: 64 bit architectures)
-            bc.KSET(slot+1, (ptrdiff_t)owningMethod(), r->d_loc.packed() );
+            // the token identifies the method to return from
+            Q_ASSERT( owningMethod()->d_nlrToken != 0 );
+            bc.KSET(slot+1, int(owningMethod()->d_nlrToken), r->d_loc.packed() );
             bc.RET( slot, 2, r->d_loc.packed() );
             ctx.sellSlots(slot,2);
         }else
@@ -423,36 +1669,27 @@ struct LjBcGen2: public Visitor
         case Variable::InstanceLevel:
         case Variable::ClassLevel:
             {
-                int _self = selfToSlot(  a->d_loc );
+                bool toSell = false;
+                int _self = selfToSlot( &toSell, a->d_loc );
 
                 const int index = lhs->d_slot + 1; // object field indices are one-based
                 if( index <= 255 )
-                    bc.TSETi( slotStack.back(), _self, index, a->d_loc.packed() ); // self == slot(0)
+                    bc.TSETi( slotStack.back(), _self, index, a->d_loc.packed() );
                 else
                 {
                     int tmp = ctx.buySlots(1);
                     bc.KSET( tmp, quint32(index), a->d_loc.packed() );
-                    bc.TSET( slotStack.back(), _self, tmp, a->d_loc.packed() ); // self == slot(0)
+                    bc.TSET( slotStack.back(), _self, tmp, a->d_loc.packed() );
                     ctx.sellSlots(tmp);
                 }
 
-                ctx.sellSlots(_self);
+                if( toSell )
+                    ctx.sellSlots(_self);
             }
             break;
         case Variable::Argument:
         case Variable::Temporary:
-            // either local or outer value
-            if( !( block == 0 ) && lhs->d_inlinedOwner != block->d_func.data() )
-            {
-                const int tmp = ctx.buySlots(1);
-                getOuterParamTable( tmp, lhs, a->d_loc );
-                Q_ASSERT( lhs->d_slot <= 255 );
-                bc.TSETi( slotStack.back(), tmp, lhs->d_slot, a->d_loc.packed() );
-                ctx.sellSlots(tmp);
-            }else
-            {
-                bc.TSETi( slotStack.back(), 0, lhs->d_slot, a->d_loc.packed() );
-            }
+            emitStoreVar( lhs, slotStack.back(), a->d_loc );
             break;
         case Variable::Global:
             error( a->d_loc, "cannot assign to global variables" );
@@ -461,6 +1698,24 @@ struct LjBcGen2: public Visitor
         // the rhs result is still in slotStack.back() and stays there as the result of the assignment expression
     }
 
+    void emitStoreVar( Variable* lhs, quint8 val, const Loc& loc )
+    {
+        // either local or outer value
+        if( !( block == 0 ) && lhs->d_inlinedOwner != block->d_func.data() )
+        {
+            const int tmp = ctx.buySlots(1);
+            const int table = getOuterParamTable( tmp, lhs, loc );
+            Q_ASSERT( lhs->d_slot <= 255 );
+            bc.TSETi( val, table, lhs->d_slot, loc.packed() );
+            ctx.sellSlots(tmp);
+        }else if( lhs->d_captured )
+        {
+            Q_ASSERT( ctx.paramTable >= 0 );
+            bc.TSETi( val, ctx.paramTable, lhs->d_slot, loc.packed() );
+        }else
+            bc.MOV( lhs->d_slot, val, loc.packed() );
+    }
+
     void emitBlock()
     {
         Q_ASSERT( meth != 0 && block != 0 );
@@ -475,14 +1730,21 @@ struct LjBcGen2: public Visitor
         for( int i = 0; i < b->d_func->d_inlineds.size(); i++ )
             b->d_func->d_inlineds[i]->d_slot = i+b->d_func->d_vars.size()+1;
 
-        // TODO: only do this when block is upvalue source; use slots otherwise
-        createParamArray( b->d_func.data() );
-        // slot 0 is now the param array and the other param slots are freed
+        createFrame( b->d_func.data() );
+        // slot 0 is the block instance, followed by params and locals; captured ones are in ctx.paramTable
+        cacheOuterRefs( b );
 
         for( int i = 0; i < b->d_func->d_body.size(); i++ )
         {
+            const bool last = i == b->d_func->d_body.size() - 1 &&
+                    b->d_func->d_body.last()->getTag() != Thing::T_Return;
+            tailSend = last && canTailCall( b->d_func->d_body[i].data(), false ) ?
+                        static_cast<MsgSend*>( b->d_func->d_body[i].data() ) : 0;
             b->d_func->d_body[i]->accept( this );
-            if( i == b->d_func->d_body.size() - 1 && b->d_func->d_body.last()->getTag() != Thing::T_Return )
+            tailSend = 0;
+            if( tailCalled )
+                tailCalled = false;
+            else if( last )
             {
                 // if last return is missing, add it and return last expression result
                 bc.RET( slotStack.back(),1,b->d_func->d_end.packed());
@@ -511,57 +1773,95 @@ struct LjBcGen2: public Visitor
 
         const int blockInst = ctx.buySlots(1);
         slotStack.push_back(blockInst);
+
+        if( isShared(blockNode) )
+        {
+            // the module function replaced the block function by the single instance of the block
+            bc.UGET( blockInst, ctx.getUpvalNr(blockNode->d_func.data()), blockNode->d_loc.packed() );
+            return;
+        }
+        if( reusing.contains(blockNode) )
+        {
+            reuseBlock( blockNode, blockInst );
+            return;
+        }
+
+        int label = -1;
+        const BlockCache::const_iterator cached = blockCache.find(blockNode);
+        if( cached != blockCache.end() )
+        {
+            // skip the instantiation if this was done in an earlier iteration of the loop
+            bc.ISNE( cached.value(), QVariant(), blockNode->d_loc.packed() );
+            bc.JMP(ctx.pool.d_frameSize,0,blockNode->d_loc.packed());
+            label = bc.getCurPc();
+        }
+
         // return a table which carries the function
 
         const int blockFunc = ctx.buySlots(1);
         const int id = ctx.getUpvalNr(blockNode->d_func.data());
         bc.UGET( blockFunc, id, blockNode->d_loc.packed() );
+        if( module.d_reused.contains(blockNode) )
+            bc.TGET( blockFunc, blockFunc, "_f", blockNode->d_loc.packed() ); // the slot has the reused instance
 
         // here we create the Block instance and associate it with the pre-existing block function.
-        bc.TNEW( blockInst, blockNode->d_func->d_inlinedLevel, 0, blockNode->d_loc.packed() );
+        bc.TNEW( blockInst, blockNode->d_func->d_inlinedLevel, 1, blockNode->d_loc.packed() );
         bc.TSET( blockFunc, blockInst,"_f", blockNode->d_loc.packed());
 
         // Block instance is also used to carry environment param tables
         // layout: index0: outer(inlinelevel0), index1: outer(inlinelevel1), ...
 
-        // slot 0 is the param array of this function (method or block) where this Block literal is spotted.
+        // ctx.paramTable is the param array of this function (method or block) where this Block literal is spotted,
+        // if there is one at all.
         if( ( block == 0 ) )
         {
             Q_ASSERT( blockNode->d_func->d_inlinedLevel == 1 );
             // we're on method level
-            // param array of this method is in slot 0
-            bc.TSETi( 0, blockInst, 0, blockNode->d_loc.packed() );
+            if( ctx.paramTable >= 0 )
+                bc.TSETi( ctx.paramTable, blockInst, 0, blockNode->d_loc.packed() );
         }else
         {
             Q_ASSERT( blockNode->d_func->d_inlinedLevel > 1 );
             // we're on block level
-            // block instance is at index 0 or the param array in slot 0
-            const int outerBlockInst = ctx.buySlots(1);
-            bc.TGETi( outerBlockInst, 0, 0, blockNode->d_loc.packed() );
+            // the block instance of this block is in slot 0
             const int tmp = ctx.buySlots(1);
             for( int i = 0; i < blockNode->d_func->d_inlinedLevel - 1; i++ )
             {
                 // copy the remaining outer param tables
-                bc.TGETi(tmp, outerBlockInst, i, blockNode->d_loc.packed() );
-                bc.TSETi( tmp, blockInst, i, blockNode->d_loc.packed() );
+                QHash<int,quint8>::const_iterator j = outerTables.find(i);
+                if( j != outerTables.end() )
+                    bc.TSETi( j.value(), blockInst, i, blockNode->d_loc.packed() );
+                else
+                {
+                    bc.TGETi(tmp, 0, i, blockNode->d_loc.packed() );
+                    bc.TSETi( tmp, blockInst, i, blockNode->d_loc.packed() );
+                }
             }
-            // param array of this block is in slot 0
-            bc.TSETi( 0, blockInst, blockNode->d_func->d_inlinedLevel - 1, blockNode->d_loc.packed() );
+            if( ctx.paramTable >= 0 )
+                bc.TSETi( ctx.paramTable, blockInst, blockNode->d_func->d_inlinedLevel - 1,
+                          blockNode->d_loc.packed() );
 
             ctx.sellSlots(tmp);
-            ctx.sellSlots(outerBlockInst);
         }
 
         ctx.sellSlots(blockFunc);
 
         emitSetmetatable( blockInst, "Block", blockNode->d_loc );
+
+        if( label >= 0 )
+        {
+            bc.MOV( cached.value(), blockInst, blockNode->d_loc.packed() );
+            bc.patch(label);
+            bc.MOV( blockInst, cached.value(), blockNode->d_loc.packed() );
+        }
     }
 
     virtual void visit( ArrayLiteral* a )
     {
         const int res = ctx.buySlots(1);
         slotStack.push_back(res);
-        bc.TNEW(res,0,0,a->d_loc.packed());
+        // pre-sized for the elements at index 1..n
+        bc.TNEW(res, a->d_elements.size() < 2047 ? a->d_elements.size() + 1 : 0, 0, a->d_loc.packed());
         emitSetmetatable( res, "Array", a->d_loc );
 
         for( int i = 0; i < a->d_elements.size(); i++ )
@@ -573,7 +1873,7 @@ struct LjBcGen2: public Visitor
             {
                 int tmp = ctx.buySlots(1);
                 bc.KSET( tmp, quint32(i+1), a->d_loc.packed() );
-                bc.TSET( slotStack.back(), 0, tmp, a->d_loc.packed() );
+                bc.TSET( slotStack.back(), res, tmp, a->d_loc.packed() );
                 ctx.sellSlots(tmp);
             }
             ctx.sellSlots(slotStack.back());
@@ -581,27 +1881,54 @@ struct LjBcGen2: public Visitor
         }
     }
 
+    void emitConst( quint8 to, const QByteArrayList& path, const Loc& loc )
+    {
+        // module constant if there is a slot left, otherwise looked up each time
+        const int slot = module.getConst(path);
+        if( slot >= 0 )
+        {
+            bc.UGET( to, ctx.getUpvalNr(slot), loc.packed() );
+            return;
+        }
+        bc.GGET( to, path.first(), loc.packed() );
+        for( int i = 1; i < path.size(); i++ )
+            bc.TGET( to, to, path[i], loc.packed() );
+    }
+
     void emitSetmetatable( int t, const QByteArray& cls, const Loc& loc )
     {
+        // all objects created by the generated code get their class this way; setmetatable and the class table
+        // are module constants, so no globals are looked up
         const int args = ctx.buySlots(3,true);
-        bc.GGET(args,"setmetatable",loc.packed() );
+        emitConst( args, QByteArrayList() << "setmetatable", loc );
         bc.MOV(args+1,t,loc.packed());
-        bc.GGET(args+2,cls,loc.packed());
-        bc.TGET(args+2,args+2,"_class",loc.packed());
+        emitConst( args+2, QByteArrayList() << cls << "_class", loc );
         bc.CALL(args,0,2,loc.packed());
         ctx.sellSlots(args,3);
     }
 
     void emitString( const QByteArray& string, const QByteArray& cls, const Loc& loc )
     {
-        const int str = ctx.buySlots(1);
-        bc.KSET(str, LuaTranspiler::escape(string), loc.packed() );
+        // String and Symbol literals are created once by the module function; Strings are immutable and
+        // Symbols are interned by _primitives, so the objects can be shared by all evaluations
+        const QByteArray ctor = cls == "Symbol" ? "_newSymbol" : "_newString";
+        const int lit = module.getLiteral( ctor, LuaTranspiler::escape(string) );
         const int res = ctx.buySlots(1);
         slotStack.push_back(res);
-        bc.TNEW(res,0,0,loc.packed());
-        bc.TSET(str,res,"_str",loc.packed());
-        ctx.sellSlots(str);
-        emitSetmetatable( res, cls, loc );
+        if( lit >= 0 )
+        {
+            bc.UGET( res, ctx.getUpvalNr(lit), loc.packed() );
+            return;
+        }
+
+        // no module slot left; create the object on each evaluation
+        const int args = ctx.buySlots(2,true);
+        bc.GGET(args,"_primitives",loc.packed() );
+        bc.TGET(args,args,ctor,loc.packed() );
+        bc.KSET(args+1, LuaTranspiler::escape(string), loc.packed() );
+        bc.CALL(args,1,1,loc.packed());
+        bc.MOV(res,args,loc.packed());
+        ctx.sellSlots(args,2);
     }
 
     virtual void visit( String* s )
@@ -622,19 +1949,28 @@ struct LjBcGen2: public Visitor
 
     virtual void visit( Number* n )
     {
-        const int res = ctx.buySlots(1);
+        const int res = resultSlot();
         slotStack.push_back(res);
         if( n->d_real )
         {
-            const int dbl = ctx.buySlots(1);
             bool ok;
-            bc.KSET(dbl, n->toNumber(&ok), n->d_loc.packed() );
+            const QVariant val = n->toNumber(&ok);
             if( !ok )
                 error(n->d_loc, QString("invalid real %1").arg(n->d_num.constData()) );
-            bc.TNEW(res,0,0,n->d_loc.packed());
-            bc.TSET(dbl,res,"_dbl",n->d_loc.packed());
-            ctx.sellSlots(dbl);
-            emitSetmetatable( res, "Double", n->d_loc );
+            // Doubles are immutable, so the literal is created once by the module function
+            const int lit = module.getLiteral( "_newDouble", val );
+            if( lit >= 0 )
+                bc.UGET( res, ctx.getUpvalNr(lit), n->d_loc.packed() );
+            else
+            {
+                const int args = ctx.buySlots(2,true);
+                bc.GGET(args,"_primitives",n->d_loc.packed() );
+                bc.TGET(args,args,"_newDouble",n->d_loc.packed() );
+                bc.KSET(args+1, val, n->d_loc.packed() );
+                bc.CALL(args,1,1,n->d_loc.packed());
+                bc.MOV(res,args,n->d_loc.packed());
+                ctx.sellSlots(args,2);
+            }
         }else
         {
             bool ok;
@@ -644,41 +1980,80 @@ struct LjBcGen2: public Visitor
         }
     }
 
-    int selfToSlot( const Loc& loc )
+    void cacheOuterRefs( Block* b )
     {
-        const int self = ctx.buySlots(1);
-        // slot 0 is parameter array for both methods and block functions
-        bc.TGETi( self, 0, 0, loc.packed() );
-        if( ( block == 0 ) )
+        // load self and the outer param tables used by the block once in the prologue instead of walking
+        // the chain from the block instance on each access
+        FindOuterRefs v( b->d_func.data() );
+        for( int i = 0; i < b->d_func->d_body.size(); i++ )
+            b->d_func->d_body[i]->accept(&v);
+        for( int i = 0; i < v.blocks.size(); i++ )
         {
-            // we are on method level; self is already propperly fetched
-        }else
+            if( isShared(v.blocks[i]) )
+                continue;
+            for( int j = 0; j < b->d_func->d_inlinedLevel; j++ )
+                v.levels << j;
+        }
+        for( int level = 0; level < b->d_func->d_inlinedLevel; level++ )
+        {
+            if( !v.levels.contains(level) )
+                continue;
+            const int slot = ctx.buySlots(1);
+            bc.TGETi( slot, 0, level, b->d_loc.packed() );
+            outerTables[level] = slot;
+        }
+        if( v.self )
         {
-            // we are on block level; self currently points to the current block instance
-            // self is also used as a temporary here
-            // the params table of the method level is at index 0 of the block instance
-            bc.TGETi( self, self, 0, loc.packed() );
-            // the method level self is at index 0 of the method params table
-            bc.TGETi( self, self, 0, loc.packed() );
+            selfSlot = ctx.buySlots(1);
+            if( outerTables.contains(0) )
+                bc.TGETi( selfSlot, outerTables[0], 0, b->d_loc.packed() );
+            else
+            {
+                bc.TGETi( selfSlot, 0, 0, b->d_loc.packed() );
+                bc.TGETi( selfSlot, selfSlot, 0, b->d_loc.packed() );
+            }
         }
+    }
+
+    int selfToSlot( bool* toSell, const Loc& loc )
+    {
+        if( toSell )
+            *toSell = false;
+        if( inl )
+            return inl->self; // the receiver of the inlined method
+        if( ( block == 0 ) )
+            return 0; // we are on method level; self is in slot 0
+        if( selfSlot >= 0 )
+            return selfSlot; // loaded by the block prologue
+
+        // we are on block level; slot 0 is the current block instance
+        const int self = ctx.buySlots(1);
+        if( toSell )
+            *toSell = true;
+        // the params table of the method level is at index 0 of the block instance
+        bc.TGETi( self, 0, 0, loc.packed() );
+        // the method level self is at index 0 of the method params table
+        bc.TGETi( self, self, 0, loc.packed() );
         return self;
     }
 
-    void getOuterParamTable( quint8 to, Variable* v, const Loc& loc )
+    quint8 getOuterParamTable( quint8 to, Variable* v, const Loc& loc )
     {
         Q_ASSERT( !( block == 0 ) && v->d_inlinedOwner != block->d_func.data() );
-        // we're on block level
+        // we're on block level; slot 0 contains the Block instance
+        Q_ASSERT( v->d_captured );
 
-        bc.TGETi( to, 0, 0, loc.packed() );
-        // "to" now contains the Block instance
-
-        bc.TGETi( to, to, v->d_inlinedOwner->d_inlinedLevel, loc.packed() );
+        QHash<int,quint8>::const_iterator i = outerTables.find( v->d_inlinedOwner->d_inlinedLevel );
+        if( i != outerTables.end() )
+            return i.value(); // loaded by the block prologue
+        bc.TGETi( to, 0, v->d_inlinedOwner->d_inlinedLevel, loc.packed() );
         // to now contains the param table
+        return to;
     }
 
     virtual void visit( Ident* id )
     {
-        const int res = ctx.buySlots(1);
+        const int res = resultSlot();
         slotStack.push_back( res );
         if( id->d_resolved )
         {
@@ -695,7 +2070,8 @@ struct LjBcGen2: public Visitor
                     case Variable::InstanceLevel:
                     case Variable::ClassLevel:
                         {
-                            const int _self = selfToSlot( id->d_loc );
+                            bool toSell = false;
+                            const int _self = selfToSlot( &toSell, id->d_loc );
 
                             const int index = v->d_slot + 1; // object field indices are one-based
                             if( index <= 255 )
@@ -708,21 +2084,28 @@ struct LjBcGen2: public Visitor
                                 ctx.sellSlots(tmp);
                             }
 
-                            ctx.sellSlots(_self);
+                            if( toSell )
+                                ctx.sellSlots(_self);
                         }
                         break;
                     case Variable::Argument:
                     case Variable::Temporary:
                         // either local or outer value
-                        if( !( block == 0 ) && v->d_inlinedOwner != block->d_func.data() )
+                        if( inl && v->d_owner == inl->callee )
                         {
-                            getOuterParamTable( res, v, id->d_loc );
+                            Q_ASSERT( v->d_kind == Variable::Argument && v->d_slot > 0 );
+                            bc.MOV( res, inl->args[v->d_slot - 1], id->d_loc.packed() );
+                        }else if( !( block == 0 ) && v->d_inlinedOwner != block->d_func.data() )
+                        {
+                            const int table = getOuterParamTable( res, v, id->d_loc );
                             Q_ASSERT( v->d_slot <= 255 );
-                            bc.TGETi( res, res, v->d_slot, id->d_loc.packed() );
-                        }else
+                            bc.TGETi( res, table, v->d_slot, id->d_loc.packed() );
+                        }else if( v->d_captured )
                         {
-                            bc.TGETi( res, 0, v->d_slot, id->d_loc.packed() );
-                        }
+                            Q_ASSERT( ctx.paramTable >= 0 );
+                            bc.TGETi( res, ctx.paramTable, v->d_slot, id->d_loc.packed() );
+                        }else
+                            bc.MOV( res, v->d_slot, id->d_loc.packed() );
                         break;
                     case Variable::Global:
                         bc.GGET(res, v->d_name, id->d_loc.packed() );
@@ -748,8 +2131,13 @@ struct LjBcGen2: public Visitor
                 bc.KSET(res,false,id->d_loc.packed());
                 break;
             case Expression::_self:
+                if( inl )
+                {
+                    bc.MOV( res, inl->self, id->d_loc.packed() );
+                    break;
+                }
                 Q_ASSERT( block == 0 );
-                bc.TGETi( res, 0, 0, id->d_loc.packed() );
+                bc.MOV( res, 0, id->d_loc.packed() );
                 break;
             default:
                 Q_ASSERT( false );
@@ -764,19 +2152,102 @@ struct LjBcGen2: public Visitor
 
 };
 
-bool LjbcCompiler2::translate(Lua::JitComposer& bc, Ast::Method* m)
+bool LjbcCompiler2::translate(Lua::JitComposer& bc, Module& mod, Ast::Method* m)
 {
     Q_ASSERT( m && m->d_owner && m->d_owner->getTag() == Ast::Thing::T_Class );
-    Ast::Class* c = static_cast<Ast::Class*>( m->d_owner );
-    LjBcGen2 gen(bc,m, 0);
+    LjBcGen2 gen(bc, mod, m, 0);
     gen.emitMethod();
     return false;
 }
 
-bool LjbcCompiler2::translate(Lua::JitComposer& bc, Method* m, Block* b)
+bool LjbcCompiler2::translate(Lua::JitComposer& bc, Module& mod, Method* m, Block* b)
 {
     Q_ASSERT( m && m->d_owner && m->d_owner->getTag() == Ast::Thing::T_Class );
-    LjBcGen2 gen(bc, m, b);
+    LjBcGen2 gen(bc, mod, m, b);
     gen.emitBlock();
     return true;
 }
+
+int LjbcCompiler2::Module::getConst(const QByteArrayList& path)
+{
+    Q_ASSERT( !path.isEmpty() );
+    const QByteArray key = path.join('.');
+    QHash<QByteArray,quint8>::const_iterator i = d_constSlots.find(key);
+    if( i != d_constSlots.end() )
+        return i.value();
+    int slot;
+    if( !takeSlot(d_pool,&slot) )
+        return -1; // the caller has to do without
+    d_constSlots.insert(key,slot);
+    d_consts.append( qMakePair(quint8(slot),path) );
+    return slot;
+}
+
+int LjbcCompiler2::Module::getLiteral(const QByteArray& ctor, const QVariant& value)
+{
+    const QByteArray key = ctor + ':' + ( value.type() == QVariant::Double ?
+                                              QByteArray::number(value.toDouble(),'g',17) : value.toByteArray() );
+    QHash<QByteArray,quint8>::const_iterator i = d_literalSlots.find(key);
+    if( i != d_literalSlots.end() )
+        return i.value();
+    int slot;
+    if( !takeSlot(d_pool,&slot) )
+        return -1; // the caller has to do without
+    d_literalSlots.insert(key,slot);
+    Literal l;
+    l.d_slot = slot;
+    l.d_ctor = ctor;
+    l.d_value = value;
+    d_literals.append( l );
+    return slot;
+}
+
+bool LjbcCompiler2::Module::takeSlot(Lua::JitComposer::SlotPool& pool, int* slot)
+{
+    // the slots of the module function stay taken until its end, where loadConsts needs two more on top
+    *slot = Lua::JitComposer::nextFreeSlot(pool,1);
+    if( *slot < 0 )
+        return false;
+    const int args = Lua::JitComposer::nextFreeSlot(pool,2,true);
+    if( args < 0 )
+    {
+        Lua::JitComposer::releaseSlot(pool,*slot);
+        *slot = -1;
+        return false;
+    }
+    Lua::JitComposer::releaseSlot(pool,args,2);
+    return true;
+}
+
+void LjbcCompiler2::loadConsts(Lua::JitComposer& bc, Module& mod, const Loc& loc)
+{
+    // the constants are fetched at the end of the module function (i.e. after all methods of the class are
+    // installed) and before the module slots are closed, so the functions see them as upvalue values
+    for( int i = 0; i < mod.d_consts.size(); i++ )
+    {
+        const quint8 slot = mod.d_consts[i].first;
+        const QByteArrayList& path = mod.d_consts[i].second;
+        bc.GGET( slot, path.first(), loc.packed() );
+        for( int j = 1; j < path.size(); j++ )
+            bc.TGET( slot, slot, path[j], loc.packed() );
+    }
+    if( mod.d_literals.isEmpty() )
+        return;
+    const int args = Lua::JitComposer::nextFreeSlot(mod.d_pool,2,true);
+    Q_ASSERT( args >= 0 );
+    for( int i = 0; i < mod.d_literals.size(); i++ )
+    {
+        const Module::Literal& l = mod.d_literals[i];
+        bc.GGET( args, "_primitives", loc.packed() );
+        bc.TGET( args, args, l.d_ctor, loc.packed() );
+        bc.KSET( args+1, l.d_value, loc.packed() );
+        bc.CALL( args, 1, 1, loc.packed() );
+        bc.MOV( l.d_slot, args, loc.packed() );
+    }
+    Lua::JitComposer::releaseSlot(mod.d_pool,args,2);
+}
+
+QByteArray LjbcCompiler2::buildStamp()
+{
+    return __DATE__ " " __TIME__; // changes whenever this file is compiled
+}
@@ -29,8 +29,60 @@ namespace Som
     class LjbcCompiler2
     {
     public:
-        static bool translate( Lua::JitComposer&, Ast::Method* );
-        static bool translate( Lua::JitComposer&, Ast::Method*, Ast::Block* );
+        enum Option {
+            IntegerFastPath = 0x01, // inline arithmetic and comparisons guarded by an Integer receiver check
+            Devirtualize = 0x02, // call the methods of sends with a statically known target via module upvalues
+            InlineMethods = 0x04, // replace sends to small methods by their body
+            NlrAnalysis = 0x08, // only check for non-local returns after sends which can pass one through
+            TailCalls = 0x10, // sends in return position are tail calls (CALLT)
+            ReuseBlocks = 0x20, // block literals passed to params which never escape use one instance per literal
+            Customize = 0x40, // inherited methods are compiled again for subclasses in which more self sends are bound
+            Peephole = 0x80, // the bytecode of each class module is optimized by LjbcPeephole before it is loaded
+            DefaultOptions = IntegerFastPath | Devirtualize | InlineMethods | NlrAnalysis | TailCalls | ReuseBlocks |
+                Peephole
+        };
+
+        struct Module
+        {
+            // state of the module function of a class which is shared by all methods and blocks of the class
+            Lua::JitComposer::SlotPool& d_pool;
+            quint32 d_options;
+            typedef QList< QPair<quint8,QByteArrayList> > Consts; // module slot -> path starting with a global
+            Consts d_consts;
+            QHash<QByteArray,quint8> d_constSlots;
+            typedef QHash<Ast::MsgSend*,QByteArrayList> Bound; // send -> path of the method it always calls
+            Bound d_bound;
+            struct Inline
+            {
+                Ast::Method* d_callee;
+                QByteArrayList d_guard; // path of d_callee if the receiver has to be checked
+                Inline():d_callee(0){}
+            };
+            typedef QHash<Ast::MsgSend*,Inline> Inlines; // send -> small method the body of which replaces it
+            Inlines d_inlines;
+            const QSet<QByteArray>* d_nlrSelectors; // sends which can return non-locally; all if null
+            bool d_integerPrimitives; // Integer has the methods of Integer.som assumed by IntegerFastPath
+            QSet<Ast::Block*> d_reused; // block literals whose single instance is created by the module function
+            struct Literal
+            {
+                quint8 d_slot;
+                QByteArray d_ctor; // the _primitives function creating the object
+                QVariant d_value;
+            };
+            typedef QList<Literal> Literals; // String, Symbol and Double objects created once by the module function
+            Literals d_literals;
+            QHash<QByteArray,quint8> d_literalSlots;
+            Module( Lua::JitComposer::SlotPool& pool, quint32 options ):d_pool(pool),d_options(options),
+                d_nlrSelectors(0),d_integerPrimitives(false){}
+            int getConst( const QByteArrayList& path );
+            int getLiteral( const QByteArray& ctor, const QVariant& value );
+            static bool takeSlot( Lua::JitComposer::SlotPool&, int* slot ); // keeps the call slots of loadConsts free
+        };
+
+        static bool translate( Lua::JitComposer&, Module&, Ast::Method* );
+        static bool translate( Lua::JitComposer&, Module&, Ast::Method*, Ast::Block* );
+        static void loadConsts( Lua::JitComposer&, Module&, const Ast::Loc& );
+        static QByteArray buildStamp(); // see LjObjectManager::cacheKey
 
     private:
         LjbcCompiler2();
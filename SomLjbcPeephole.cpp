@@ -0,0 +1,982 @@
+/*
+* Copyright 2020 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the SOM Smalltalk parser/compiler library.
+*
+* The following is the license that applies to this copy of the
+* library. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "SomLjbcPeephole.h"
+#include <QVector>
+#include <QList>
+using namespace Som;
+
+/*
+ NOTE: the optimizer works on the finished dump so it sees the code of all functions of a class module as LuaJIT
+ will see it; the constants are passed through untouched, only the bytecode, the frame size and the debug info
+ of each function are rewritten. Per function and until nothing changes any more:
+ - a JMP to a JMP is redirected to the final target (jump threading)
+ - a JMP to the next instruction is removed unless it belongs to a preceding comparison or test
+ - "MOV t, x" followed by an instruction which reads t reads x instead (copy propagation); the MOV is then
+   usually dead and goes away with the next point
+ - side effect free stores (MOV, NOT, K*, UGET, FNEW, TNEW, TDUP) to slots which are not live are removed
+ - "op t, ...; MOV x, t" with t not live afterwards becomes "op x, ..." (slot coalescing of temporaries)
+ - the frame size is reduced to the slots which are still referenced
+ Slots which are captured by a closure are left alone in functions with FNEW, since they can be read and written
+ by calls. Calls are assumed to leave the slots above their results alone, and conditional stores (ISTC, FORL,
+ etc.) are not counted as kills, so the liveness errs on the side of keeping code.
+ Slots are not renumbered; the variable info of the debugger implies the slot of each variable by its order
+ and the call frames need consecutive slots.
+*/
+
+namespace
+{
+enum Op { // LuaJIT 2.0, see lj_bc.h
+    BC_ISLT, BC_ISGE, BC_ISLE, BC_ISGT, BC_ISEQV, BC_ISNEV, BC_ISEQS, BC_ISNES, BC_ISEQN, BC_ISNEN,
+    BC_ISEQP, BC_ISNEP, BC_ISTC, BC_ISFC, BC_IST, BC_ISF,
+    BC_MOV, BC_NOT, BC_UNM, BC_LEN,
+    BC_ADDVN, BC_SUBVN, BC_MULVN, BC_DIVVN, BC_MODVN,
+    BC_ADDNV, BC_SUBNV, BC_MULNV, BC_DIVNV, BC_MODNV,
+    BC_ADDVV, BC_SUBVV, BC_MULVV, BC_DIVVV, BC_MODVV,
+    BC_POW, BC_CAT,
+    BC_KSTR, BC_KCDATA, BC_KSHORT, BC_KNUM, BC_KPRI, BC_KNIL,
+    BC_UGET, BC_USETV, BC_USETS, BC_USETN, BC_USETP, BC_UCLO, BC_FNEW,
+    BC_TNEW, BC_TDUP, BC_GGET, BC_GSET, BC_TGETV, BC_TGETS, BC_TGETB, BC_TSETV, BC_TSETS, BC_TSETB, BC_TSETM,
+    BC_CALLM, BC_CALL, BC_CALLMT, BC_CALLT, BC_ITERC, BC_ITERN, BC_VARG, BC_ISNEXT,
+    BC_RETM, BC_RET, BC_RET0, BC_RET1,
+    BC_FORI, BC_JFORI, BC_FORL, BC_IFORL, BC_JFORL, BC_ITERL, BC_IITERL, BC_JITERL, BC_LOOP, BC_ILOOP, BC_JLOOP,
+    BC_JMP
+};
+
+enum { DumpVersion = 1, DumpBigEndian = 0x01, DumpStrip = 0x02, UvLocal = 0x8000, VarNameMax = 7, MaxSlot = 255 };
+
+struct Slots
+{
+    quint64 d_bits[4];
+    Slots() { d_bits[0] = d_bits[1] = d_bits[2] = d_bits[3] = 0; }
+    void set( int s )
+    {
+        if( s >= 0 && s <= MaxSlot )
+            d_bits[s >> 6] |= quint64(1) << ( s & 63 );
+    }
+    void set( int from, int to )
+    {
+        for( int s = from; s <= to; s++ )
+            set(s);
+    }
+    bool test( int s ) const
+    {
+        return s >= 0 && s <= MaxSlot && ( ( d_bits[s >> 6] >> ( s & 63 ) ) & 1 );
+    }
+    bool testAny( int from, int to ) const
+    {
+        for( int s = from; s <= to; s++ )
+            if( test(s) )
+                return true;
+        return false;
+    }
+    void add( const Slots& rhs )
+    {
+        for( int i = 0; i < 4; i++ )
+            d_bits[i] |= rhs.d_bits[i];
+    }
+    void remove( const Slots& rhs )
+    {
+        for( int i = 0; i < 4; i++ )
+            d_bits[i] &= ~rhs.d_bits[i];
+    }
+    bool operator!=( const Slots& rhs ) const
+    {
+        for( int i = 0; i < 4; i++ )
+            if( d_bits[i] != rhs.d_bits[i] )
+                return true;
+        return false;
+    }
+};
+
+struct Var
+{
+    QByteArray d_name; // including the terminating zero, or a single type byte
+    quint32 d_start, d_end; // pc of the first instruction and after the last one, pc 0 is the function header
+};
+
+struct Proto
+{
+    quint8 d_flags, d_numparams, d_framesize, d_numuv;
+    quint32 d_numkgc, d_numkn;
+    QVector<quint32> d_bc;
+    QByteArray d_uv;
+    QByteArray d_consts; // kgc and kn, passed through
+    bool d_hasDebug;
+    quint32 d_firstline, d_numline;
+    int d_lineWidth;
+    QByteArray d_lineinfo;
+    QByteArray d_uvnames;
+    QList<Var> d_vars;
+    Proto():d_flags(0),d_numparams(0),d_framesize(0),d_numuv(0),d_numkgc(0),d_numkn(0),d_hasDebug(false),
+        d_firstline(0),d_numline(0),d_lineWidth(1){}
+};
+
+struct Reader
+{
+    const QByteArray& d_data;
+    int d_pos;
+    int d_end;
+    bool d_ok;
+    Reader( const QByteArray& data, int pos = 0, int end = -1 ):d_data(data),d_pos(pos),
+        d_end( end < 0 ? data.size() : end ),d_ok(true){}
+    bool atEnd() const { return d_pos >= d_end; }
+    quint8 byte()
+    {
+        if( d_pos >= d_end )
+        {
+            d_ok = false;
+            return 0;
+        }
+        return quint8(d_data[d_pos++]);
+    }
+    quint32 uleb()
+    {
+        quint32 res = 0;
+        int shift = 0;
+        quint8 b;
+        do
+        {
+            b = byte();
+            if( shift < 32 )
+                res |= quint32( b & 0x7f ) << shift;
+            shift += 7;
+        }while( d_ok && ( b & 0x80 ) );
+        return res;
+    }
+    QByteArray bytes( int len )
+    {
+        if( len < 0 || d_end - d_pos < len )
+        {
+            d_ok = false;
+            return QByteArray();
+        }
+        const QByteArray res = d_data.mid(d_pos,len);
+        d_pos += len;
+        return res;
+    }
+    QByteArray string()
+    {
+        const int start = d_pos;
+        while( d_ok && byte() != 0 )
+            ;
+        return d_data.mid(start, d_pos - start);
+    }
+};
+}
+
+static void appendUleb( QByteArray& out, quint32 v )
+{
+    while( v >= 0x80 )
+    {
+        out += char( ( v & 0x7f ) | 0x80 );
+        v >>= 7;
+    }
+    out += char(v);
+}
+
+static inline int opOf( quint32 i ) { return i & 0xff; }
+static inline int aOf( quint32 i ) { return ( i >> 8 ) & 0xff; }
+static inline int cOf( quint32 i ) { return ( i >> 16 ) & 0xff; }
+static inline int bOf( quint32 i ) { return i >> 24; }
+static inline int dOf( quint32 i ) { return i >> 16; }
+static inline quint32 setA( quint32 i, int a ) { return ( i & 0xffff00ff ) | ( quint32(a) << 8 ); }
+static inline quint32 setB( quint32 i, int b ) { return ( i & 0x00ffffff ) | ( quint32(b) << 24 ); }
+static inline quint32 setC( quint32 i, int c ) { return ( i & 0xff00ffff ) | ( quint32(c) << 16 ); }
+static inline quint32 setD( quint32 i, int d ) { return ( i & 0x0000ffff ) | ( quint32(d) << 16 ); }
+
+static bool hasJump( int op )
+{
+    switch( op )
+    {
+    case BC_UCLO:
+    case BC_ISNEXT:
+    case BC_FORI:
+    case BC_FORL:
+    case BC_IFORL:
+    case BC_ITERL:
+    case BC_IITERL:
+    case BC_LOOP:
+    case BC_ILOOP:
+    case BC_JMP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline int jumpTarget( int pc, quint32 i )
+{
+    return pc + 1 + dOf(i) - 0x8000;
+}
+
+static inline bool isTest( int op )
+{
+    // comparisons and tests are always followed by the JMP which is executed if the condition holds
+    return op <= BC_ISF;
+}
+
+static int successors( const QVector<quint32>& bc, int pc, int* out )
+{
+    const int op = opOf(bc[pc]);
+    if( isTest(op) )
+    {
+        out[0] = pc + 1;
+        out[1] = pc + 2;
+        return 2;
+    }
+    switch( op )
+    {
+    case BC_JMP:
+    case BC_UCLO:
+    case BC_ISNEXT:
+        out[0] = jumpTarget(pc,bc[pc]);
+        return 1;
+    case BC_RETM:
+    case BC_RET:
+    case BC_RET0:
+    case BC_RET1:
+    case BC_CALLMT:
+    case BC_CALLT:
+        return 0;
+    case BC_FORI:
+    case BC_FORL:
+    case BC_IFORL:
+    case BC_ITERL:
+    case BC_IITERL:
+    case BC_LOOP: // the interpreter falls through, the target is the loop exit for the JIT
+    case BC_ILOOP:
+        out[0] = pc + 1;
+        out[1] = jumpTarget(pc,bc[pc]);
+        return 2;
+    default:
+        out[0] = pc + 1;
+        return 1;
+    }
+}
+
+static void useDef( quint32 i, Slots& use, Slots& def )
+{
+    const int op = opOf(i);
+    const int a = aOf(i);
+    const int b = bOf(i);
+    const int c = cOf(i);
+    const int d = dOf(i);
+    if( op <= BC_ISNEV )
+    {
+        use.set(a);
+        use.set(d);
+        return;
+    }
+    if( op <= BC_ISNEP )
+    {
+        use.set(a);
+        return;
+    }
+    switch( op )
+    {
+    case BC_ISTC:
+    case BC_ISFC: // A is only written if the jump is taken
+    case BC_IST:
+    case BC_ISF:
+    case BC_USETV:
+        use.set(d);
+        break;
+    case BC_MOV:
+    case BC_NOT:
+    case BC_UNM:
+    case BC_LEN:
+        use.set(d);
+        def.set(a);
+        break;
+    case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN: case BC_MODVN:
+    case BC_ADDNV: case BC_SUBNV: case BC_MULNV: case BC_DIVNV: case BC_MODNV:
+    case BC_TGETS:
+    case BC_TGETB:
+        use.set(b);
+        def.set(a);
+        break;
+    case BC_ADDVV: case BC_SUBVV: case BC_MULVV: case BC_DIVVV: case BC_MODVV:
+    case BC_POW:
+    case BC_TGETV:
+        use.set(b);
+        use.set(c);
+        def.set(a);
+        break;
+    case BC_CAT:
+        use.set(b,c);
+        def.set(a);
+        break;
+    case BC_KSTR:
+    case BC_KCDATA:
+    case BC_KSHORT:
+    case BC_KNUM:
+    case BC_KPRI:
+    case BC_UGET:
+    case BC_FNEW:
+    case BC_TNEW:
+    case BC_TDUP:
+    case BC_GGET:
+        def.set(a);
+        break;
+    case BC_KNIL:
+        def.set(a,d);
+        break;
+    case BC_GSET:
+        use.set(a);
+        break;
+    case BC_TSETS:
+    case BC_TSETB:
+        use.set(a);
+        use.set(b);
+        break;
+    case BC_TSETV:
+        use.set(a);
+        use.set(b);
+        use.set(c);
+        break;
+    case BC_TSETM:
+        use.set(a-1,MaxSlot);
+        break;
+    case BC_CALL:
+        use.set(a,a+c-1);
+        def.set(a,a+b-2);
+        break;
+    case BC_CALLM:
+        use.set(a,MaxSlot);
+        def.set(a,a+b-2);
+        break;
+    case BC_CALLT:
+        use.set(a,a+d-1);
+        break;
+    case BC_CALLMT:
+    case BC_RETM:
+        use.set(a,MaxSlot);
+        break;
+    case BC_ITERC:
+    case BC_ITERN:
+        use.set(a-3,a-1);
+        def.set(a,a+b-2);
+        break;
+    case BC_VARG:
+        def.set(a,a+b-2);
+        break;
+    case BC_ISNEXT:
+        use.set(a-3,a-1);
+        break;
+    case BC_RET:
+        use.set(a,a+d-2);
+        break;
+    case BC_RET1:
+        use.set(a);
+        break;
+    case BC_FORI: // the stores of the loop instructions depend on the outcome
+    case BC_FORL:
+    case BC_IFORL:
+        use.set(a,a+2);
+        break;
+    case BC_ITERL:
+    case BC_IITERL:
+        use.set(a);
+        break;
+    default:
+        // USETS, USETN, USETP, UCLO, RET0, LOOP, JMP
+        break;
+    }
+}
+
+static int highestSlot( quint32 i )
+{
+    // the highest slot the instruction refers to, -1 if none
+    const int op = opOf(i);
+    const int a = aOf(i);
+    const int b = bOf(i);
+    const int c = cOf(i);
+    const int d = dOf(i);
+    if( op <= BC_ISNEV )
+        return qMax(a,d);
+    if( op <= BC_ISNEP )
+        return a;
+    switch( op )
+    {
+    case BC_ISTC:
+    case BC_ISFC:
+    case BC_MOV:
+    case BC_NOT:
+    case BC_UNM:
+    case BC_LEN:
+        return qMax(a,d);
+    case BC_IST:
+    case BC_ISF:
+    case BC_USETV:
+        return d;
+    case BC_KNIL:
+        return qMax(a,d);
+    case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN: case BC_MODVN:
+    case BC_ADDNV: case BC_SUBNV: case BC_MULNV: case BC_DIVNV: case BC_MODNV:
+    case BC_TGETS:
+    case BC_TGETB:
+    case BC_TSETS:
+    case BC_TSETB:
+        return qMax(a,b);
+    case BC_ADDVV: case BC_SUBVV: case BC_MULVV: case BC_DIVVV: case BC_MODVV:
+    case BC_POW:
+    case BC_CAT:
+    case BC_TGETV:
+    case BC_TSETV:
+        return qMax(a,qMax(b,c));
+    case BC_KSTR:
+    case BC_KCDATA:
+    case BC_KSHORT:
+    case BC_KNUM:
+    case BC_KPRI:
+    case BC_UGET:
+    case BC_FNEW:
+    case BC_TNEW:
+    case BC_TDUP:
+    case BC_GGET:
+    case BC_GSET:
+    case BC_TSETM:
+    case BC_RET1:
+    case BC_ITERL:
+    case BC_IITERL:
+        return a;
+    case BC_CALL:
+        return qMax(a+c-1,a+b-2);
+    case BC_CALLM:
+        return qMax(a+c,a+b-2);
+    case BC_CALLT:
+        return a+d-1;
+    case BC_CALLMT:
+    case BC_RETM:
+        return a+d;
+    case BC_ITERC:
+    case BC_ITERN:
+        return qMax(a+2,a+b-2);
+    case BC_VARG:
+        return qMax(a,a+b-2);
+    case BC_ISNEXT:
+        return a-1;
+    case BC_RET:
+        return a+d-2;
+    case BC_FORI:
+    case BC_FORL:
+    case BC_IFORL:
+        return a+3;
+    default:
+        // USETS, USETN, USETP, UCLO, RET0, LOOP, JMP; the A of the latter three is a hint or a lower bound only
+        return -1;
+    }
+}
+
+static bool isPure( int op )
+{
+    // the only effect of the instruction is the store to its destination slots
+    switch( op )
+    {
+    case BC_MOV:
+    case BC_NOT:
+    case BC_KSTR:
+    case BC_KCDATA:
+    case BC_KSHORT:
+    case BC_KNUM:
+    case BC_KPRI:
+    case BC_KNIL:
+    case BC_UGET:
+    case BC_FNEW:
+    case BC_TNEW:
+    case BC_TDUP:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool writesOnlyA( int op )
+{
+    // the instruction reads its operands before it stores one value to A, so A can be exchanged
+    return ( op >= BC_MOV && op <= BC_POW ) || ( op >= BC_KSTR && op <= BC_KPRI ) || op == BC_UGET ||
+            op == BC_FNEW || op == BC_TNEW || op == BC_TDUP || op == BC_GGET ||
+            ( op >= BC_TGETV && op <= BC_TGETB );
+}
+
+static bool substitute( quint32& i, int from, int to )
+{
+    // replaces reads of slot 'from' by reads of slot 'to' where the instruction reads a single slot
+    const int op = opOf(i);
+    const quint32 old = i;
+    bool a = false, b = false, c = false, d = false;
+    if( op <= BC_ISNEV )
+        a = d = true;
+    else if( op <= BC_ISNEP )
+        a = true;
+    else switch( op )
+    {
+    case BC_ISTC:
+    case BC_ISFC:
+    case BC_IST:
+    case BC_ISF:
+    case BC_MOV:
+    case BC_NOT:
+    case BC_UNM:
+    case BC_LEN:
+    case BC_USETV:
+        d = true;
+        break;
+    case BC_ADDVN: case BC_SUBVN: case BC_MULVN: case BC_DIVVN: case BC_MODVN:
+    case BC_ADDNV: case BC_SUBNV: case BC_MULNV: case BC_DIVNV: case BC_MODNV:
+    case BC_TGETS:
+    case BC_TGETB:
+        b = true;
+        break;
+    case BC_ADDVV: case BC_SUBVV: case BC_MULVV: case BC_DIVVV: case BC_MODVV:
+    case BC_POW:
+    case BC_TGETV:
+        b = c = true;
+        break;
+    case BC_GSET:
+        a = true;
+        break;
+    case BC_TSETS:
+    case BC_TSETB:
+        a = b = true;
+        break;
+    case BC_TSETV:
+        a = b = c = true;
+        break;
+    default:
+        break;
+    }
+    if( a && aOf(i) == from )
+        i = setA(i,to);
+    if( b && bOf(i) == from )
+        i = setB(i,to);
+    if( c && cOf(i) == from )
+        i = setC(i,to);
+    if( d && dOf(i) == from )
+        i = setD(i,to);
+    return i != old;
+}
+
+static quint32 remapPc( const QVector<int>& kept, quint32 pc )
+{
+    // kept[n] is the number of remaining instructions before the old instruction n
+    if( pc == 0 )
+        return 0;
+    const int n = qMin( int(pc) - 1, kept.size() - 1 );
+    return kept[n] + 1;
+}
+
+static void compact( Proto& p, const QVector<bool>& removed )
+{
+    const int n = p.d_bc.size();
+    QVector<int> kept(n+1);
+    int count = 0;
+    for( int i = 0; i < n; i++ )
+    {
+        kept[i] = count;
+        if( !removed[i] )
+            count++;
+    }
+    kept[n] = count;
+
+    QVector<quint32> bc;
+    bc.reserve(count);
+    QByteArray lineinfo;
+    for( int i = 0; i < n; i++ )
+    {
+        if( removed[i] )
+            continue;
+        quint32 ins = p.d_bc[i];
+        if( hasJump(opOf(ins)) )
+        {
+            const int to = kept[jumpTarget(i,ins)];
+            ins = setD( ins, to - ( kept[i] + 1 ) + 0x8000 );
+        }
+        bc.append(ins);
+        if( !p.d_lineinfo.isEmpty() )
+            lineinfo += p.d_lineinfo.mid( i * p.d_lineWidth, p.d_lineWidth );
+    }
+    p.d_bc = bc;
+    p.d_lineinfo = lineinfo;
+    for( int i = 0; i < p.d_vars.size(); i++ )
+    {
+        p.d_vars[i].d_start = remapPc(kept,p.d_vars[i].d_start);
+        p.d_vars[i].d_end = remapPc(kept,p.d_vars[i].d_end);
+    }
+}
+
+static bool threadJumps( Proto& p )
+{
+    bool changed = false;
+    const int n = p.d_bc.size();
+    for( int i = 0; i < n; i++ )
+    {
+        const quint32 ins = p.d_bc[i];
+        if( opOf(ins) != BC_JMP )
+            continue;
+        int to = jumpTarget(i,ins);
+        int guard = 0;
+        while( to != i && opOf(p.d_bc[to]) == BC_JMP && guard++ < 16 )
+        {
+            const int next = jumpTarget(to,p.d_bc[to]);
+            if( next == to )
+                break;
+            to = next;
+        }
+        if( to != jumpTarget(i,ins) )
+        {
+            p.d_bc[i] = setD( ins, to - ( i + 1 ) + 0x8000 );
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void liveness( const Proto& p, const Slots& pinned, QVector<Slots>& liveOut )
+{
+    const int n = p.d_bc.size();
+    QVector<Slots> use(n), def(n), liveIn(n);
+    liveOut = QVector<Slots>(n);
+    for( int i = 0; i < n; i++ )
+        useDef( p.d_bc[i], use[i], def[i] );
+    bool changed = true;
+    while( changed )
+    {
+        changed = false;
+        for( int i = n - 1; i >= 0; i-- )
+        {
+            Slots out = pinned;
+            int succ[2];
+            const int count = successors(p.d_bc,i,succ);
+            for( int j = 0; j < count; j++ )
+            {
+                if( succ[j] < n )
+                    out.add(liveIn[succ[j]]);
+            }
+            Slots in = out;
+            in.remove(def[i]);
+            in.add(use[i]);
+            liveOut[i] = out;
+            if( in != liveIn[i] )
+            {
+                liveIn[i] = in;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool optimizeOnce( Proto& p, const Slots& pinned )
+{
+    const int n = p.d_bc.size();
+    bool changed = threadJumps(p);
+
+    QVector<bool> target(n+1);
+    for( int i = 0; i < n; i++ )
+    {
+        if( hasJump(opOf(p.d_bc[i])) )
+            target[jumpTarget(i,p.d_bc[i])] = true;
+    }
+    QVector<Slots> liveOut;
+    liveness(p,pinned,liveOut);
+
+    QVector<bool> removed(n), touched(n);
+    for( int i = 0; i < n; i++ )
+    {
+        const quint32 ins = p.d_bc[i];
+        const int op = opOf(ins);
+        const int a = aOf(ins);
+
+        if( op == BC_JMP && jumpTarget(i,ins) == i + 1 && ( i == 0 || !isTest(opOf(p.d_bc[i-1])) ) )
+        {
+            removed[i] = true;
+            changed = true;
+            continue;
+        }
+        if( op == BC_MOV && a == dOf(ins) )
+        {
+            removed[i] = true;
+            changed = true;
+            continue;
+        }
+        if( touched[i] )
+            continue;
+        if( isPure(op) )
+        {
+            const int last = op == BC_KNIL ? dOf(ins) : a;
+            if( !liveOut[i].testAny(a,last) )
+            {
+                removed[i] = true;
+                changed = true;
+                continue;
+            }
+        }
+        if( i + 1 >= n || target[i+1] || touched[i+1] )
+            continue;
+        quint32& next = p.d_bc[i+1];
+        if( writesOnlyA(op) && opOf(next) == BC_MOV && dOf(next) == a && aOf(next) != a &&
+                !pinned.test(a) && !pinned.test(aOf(next)) && !liveOut[i+1].test(a) )
+        {
+            // op t, ...; MOV x, t -> op x, ...
+            p.d_bc[i] = setA(ins,aOf(next));
+            removed[i+1] = true;
+            touched[i] = touched[i+1] = true;
+            changed = true;
+            continue;
+        }
+        if( op == BC_MOV && a != dOf(ins) && !pinned.test(a) && !pinned.test(dOf(ins)) &&
+                substitute(next, a, dOf(ins)) )
+        {
+            // MOV t, x; op .., t, .. -> MOV t, x; op .., x, ..
+            touched[i] = touched[i+1] = true;
+            changed = true;
+        }
+    }
+    if( changed )
+        compact(p,removed);
+    return changed;
+}
+
+static void shrinkFrame( Proto& p, const Slots& pinned )
+{
+    int top = qMax( int(p.d_numparams) - 1, 0 ); // LuaJIT's minimum frame size is one
+    for( int i = 0; i < p.d_bc.size(); i++ )
+        top = qMax( top, highestSlot(p.d_bc[i]) );
+    for( int s = 0; s <= MaxSlot; s++ )
+    {
+        if( pinned.test(s) )
+            top = qMax( top, s );
+    }
+    for( int i = 0; i < p.d_vars.size(); i++ )
+    {
+        // the variables active at the start of variable i occupy the slots from 0 in declaration order
+        int active = 0;
+        for( int j = 0; j <= i; j++ )
+        {
+            if( p.d_vars[j].d_start <= p.d_vars[i].d_start && p.d_vars[i].d_start < p.d_vars[j].d_end )
+                active++;
+        }
+        top = qMax( top, active - 1 );
+    }
+    if( top + 1 < p.d_framesize )
+        p.d_framesize = top + 1;
+}
+
+static bool parseDebug( Proto& p, const QByteArray& dbg )
+{
+    p.d_lineWidth = p.d_numline < 256 ? 1 : ( p.d_numline < 65536 ? 2 : 4 );
+    Reader r(dbg);
+    p.d_lineinfo = r.bytes( p.d_bc.size() * p.d_lineWidth );
+    const int start = r.d_pos;
+    for( int i = 0; i < p.d_numuv && r.d_ok; i++ )
+        r.string();
+    p.d_uvnames = dbg.mid(start, r.d_pos - start);
+    quint32 pc = 0;
+    while( r.d_ok )
+    {
+        Var v;
+        const quint8 kind = r.byte();
+        if( kind == 0 )
+            break;
+        if( kind < VarNameMax )
+            v.d_name = QByteArray(1,char(kind));
+        else
+        {
+            r.d_pos--;
+            v.d_name = r.string();
+        }
+        pc += r.uleb();
+        v.d_start = pc;
+        v.d_end = pc + r.uleb();
+        p.d_vars.append(v);
+    }
+    return r.d_ok && r.atEnd();
+}
+
+static bool parseProto( Proto& p, const QByteArray& data, bool strip )
+{
+    Reader r(data);
+    p.d_flags = r.byte();
+    p.d_numparams = r.byte();
+    p.d_framesize = r.byte();
+    p.d_numuv = r.byte();
+    p.d_numkgc = r.uleb();
+    p.d_numkn = r.uleb();
+    const quint32 numbc = r.uleb();
+    quint32 sizedbg = 0;
+    if( !strip )
+    {
+        sizedbg = r.uleb();
+        if( sizedbg )
+        {
+            p.d_hasDebug = true;
+            p.d_firstline = r.uleb();
+            p.d_numline = r.uleb();
+        }
+    }
+    if( !r.d_ok || numbc > quint32(data.size()) || sizedbg > quint32(data.size()) )
+        return false;
+    const QByteArray bc = r.bytes( numbc * 4 );
+    p.d_uv = r.bytes( p.d_numuv * 2 );
+    p.d_consts = r.bytes( data.size() - r.d_pos - int(sizedbg) );
+    if( !r.d_ok )
+        return false;
+    p.d_bc.resize(numbc);
+    for( int i = 0; i < int(numbc); i++ )
+        p.d_bc[i] = quint8(bc[i*4]) | quint8(bc[i*4+1]) << 8 | quint8(bc[i*4+2]) << 16 | quint32(quint8(bc[i*4+3])) << 24;
+    if( sizedbg && !parseDebug( p, data.mid(r.d_pos) ) )
+        return false;
+    return true;
+}
+
+static QByteArray writeProto( const Proto& p, bool strip )
+{
+    QByteArray dbg;
+    if( p.d_hasDebug )
+    {
+        dbg = p.d_lineinfo + p.d_uvnames;
+        quint32 pc = 0;
+        for( int i = 0; i < p.d_vars.size(); i++ )
+        {
+            dbg += p.d_vars[i].d_name;
+            appendUleb( dbg, p.d_vars[i].d_start - pc );
+            appendUleb( dbg, p.d_vars[i].d_end - p.d_vars[i].d_start );
+            pc = p.d_vars[i].d_start;
+        }
+        dbg += char(0);
+    }
+    QByteArray out;
+    out += char(p.d_flags);
+    out += char(p.d_numparams);
+    out += char(p.d_framesize);
+    out += char(p.d_numuv);
+    appendUleb( out, p.d_numkgc );
+    appendUleb( out, p.d_numkn );
+    appendUleb( out, p.d_bc.size() );
+    if( !strip )
+    {
+        appendUleb( out, dbg.size() );
+        if( !dbg.isEmpty() )
+        {
+            appendUleb( out, p.d_firstline );
+            appendUleb( out, p.d_numline );
+        }
+    }
+    for( int i = 0; i < p.d_bc.size(); i++ )
+    {
+        const quint32 ins = p.d_bc[i];
+        out += char( ins & 0xff );
+        out += char( ( ins >> 8 ) & 0xff );
+        out += char( ( ins >> 16 ) & 0xff );
+        out += char( ins >> 24 );
+    }
+    out += p.d_uv;
+    out += p.d_consts;
+    out += dbg;
+    return out;
+}
+
+static bool canOptimize( const Proto& p )
+{
+    const int n = p.d_bc.size();
+    for( int i = 0; i < n; i++ )
+    {
+        const quint32 ins = p.d_bc[i];
+        const int op = opOf(ins);
+        if( op == BC_JFORI || op == BC_JFORL || op == BC_JITERL || op == BC_JLOOP || op > BC_JMP )
+            return false; // only fresh code
+        if( hasJump(op) && ( jumpTarget(i,ins) < 0 || jumpTarget(i,ins) >= n ) )
+            return false;
+        if( isTest(op) && ( i + 1 >= n || opOf(p.d_bc[i+1]) != BC_JMP ) )
+            return false;
+    }
+    return true;
+}
+
+bool LjbcPeephole::optimize(QByteArray& dump)
+{
+    if( dump.size() < 5 || dump[0] != '\x1b' || dump[1] != 'L' || dump[2] != 'J' || dump[3] != DumpVersion )
+        return false;
+    Reader r(dump,4);
+    const quint32 flags = r.uleb();
+    if( flags & DumpBigEndian )
+        return false;
+    const bool strip = flags & DumpStrip;
+    if( !strip )
+        r.bytes( r.uleb() ); // chunk name
+    const QByteArray header = dump.left(r.d_pos);
+
+    QList<Proto> protos;
+    Slots pinned;
+    while( r.d_ok )
+    {
+        const quint32 len = r.uleb();
+        if( len == 0 )
+            break;
+        Proto p;
+        if( !r.d_ok || !parseProto( p, r.bytes(len), strip ) )
+            return false;
+        for( int i = 0; i < p.d_numuv; i++ )
+        {
+            const quint16 uv = quint8(p.d_uv[i*2]) | quint8(p.d_uv[i*2+1]) << 8;
+            if( uv & UvLocal )
+                pinned.set( uv & 0xff ); // slot of the enclosing function
+        }
+        protos.append(p);
+    }
+    if( !r.d_ok )
+        return false;
+    const QByteArray trailer = dump.mid(r.d_pos);
+
+    QByteArray out = header;
+    for( int i = 0; i < protos.size(); i++ )
+    {
+        Proto& p = protos[i];
+        if( canOptimize(p) )
+        {
+            // only the functions which create closures are affected by the captured slots
+            Slots captured;
+            for( int j = 0; j < p.d_bc.size(); j++ )
+            {
+                if( opOf(p.d_bc[j]) == BC_FNEW )
+                {
+                    captured = pinned;
+                    break;
+                }
+            }
+            int guard = 0;
+            while( optimizeOnce(p,captured) && guard++ < 32 )
+                ;
+            shrinkFrame(p,captured);
+        }
+        const QByteArray data = writeProto(p,strip);
+        appendUleb( out, data.size() );
+        out += data;
+    }
+    out += char(0);
+    out += trailer;
+    dump = out;
+    return true;
+}
+
+QByteArray LjbcPeephole::buildStamp()
+{
+    return __DATE__ " " __TIME__; // changes whenever this file is compiled
+}
@@ -0,0 +1,37 @@
+#ifndef SOMLJBCPEEPHOLE_H
+#define SOMLJBCPEEPHOLE_H
+
+/*
+* Copyright 2020 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the SOM Smalltalk parser/compiler library.
+*
+* The following is the license that applies to this copy of the
+* library. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include <QByteArray>
+
+namespace Som
+{
+    class LjbcPeephole
+    {
+    public:
+        // rewrites the functions of a chunk in the LuaJIT 2.0 dump format as written by JitComposer; returns false
+        // and leaves the dump as it is if it is in a format the optimizer doesn't understand
+        static bool optimize( QByteArray& dump );
+        static QByteArray buildStamp();
+    };
+}
+
+#endif // SOMLJBCPEEPHOLE_H
@@ -473,3 +473,8 @@ QByteArray LuaTranspiler::escape(const QByteArray& string)
 {
     return _escape(string);
 }
+
+QByteArray LuaTranspiler::buildStamp()
+{
+    return __DATE__ " " __TIME__; // changes whenever this file is compiled
+}
@@ -33,6 +33,7 @@ namespace Som
         static QByteArray map(QByteArray name );
         static QByteArray map(const QByteArray& name, quint8 patternType );
         static QByteArray escape( const QByteArray& string );
+        static QByteArray buildStamp(); // see LjObjectManager::cacheKey
     private:
         LuaTranspiler();
     };
@@ -24,6 +24,10 @@ local io = require 'io'
 local math = require 'math'
 local bit = require 'bit'
 local os = require 'os'
+local ok, tnew = pcall(require, 'table.new') -- only available since LuaJIT 2.1
+if not ok then
+	tnew = function() return {} end
+end
 
 local module = {}
 
@@ -39,6 +43,7 @@ ffi.cdef [[
 	int Som_toInt32(double d);
 	unsigned int Som_toUInt32(double d);
 	int Som_rem(int l, int r);
+	typedef struct { double _dbl; } SomDouble;
 ]]
 
 function module._newString(str)
@@ -48,24 +53,54 @@ function module._newString(str)
 end
 local _str = module._newString
 
+-- Symbols are interned so equal Symbols are identical; unused ones can be collected
+local symbols = {}
+setmetatable(symbols, { __mode = "v" })
+
 function module._newSymbol(str)
-	local t = { _str = str }
-	setmetatable(t,Symbol._class)
+	local t = symbols[str]
+	if t == nil then
+		t = { _str = str }
+		setmetatable(t,Symbol._class)
+		symbols[str] = t
+	end
 	return t
 end
 local _sym = module._newSymbol
 
+-- Doubles are unboxed FFI structs instead of tables, so Double arithmetic allocates no tables and
+-- needs no setmetatable; the ctype is bound to the Double class by _initDouble once the class exists
+local SomDouble
+
+function module._initDouble(cls)
+	SomDouble = ffi.metatype("SomDouble", {
+		__index = cls._class,
+		__unm = function(self) return -self._dbl end
+	})
+end
+
 function module._newDouble(d)
-	local t = { _dbl = d }
-	setmetatable(t,Double._class)
-	return t
+	return SomDouble(d)
 end
 local _dbl = module._newDouble
 
+-- each class gets a cached constructor which creates its instances pre-sized to the number of fields
+function module._constructor( c )
+	local f = rawget(c,"_fields")
+	local n = f and #f or 0
+	local ctor = function()
+		local t = tnew(n,0)
+		setmetatable(t,c)
+		return t
+	end
+	rawset(c,"_new",ctor)
+	return ctor
+end
+
 function module._inst( cls )
-	local t = {}
-	setmetatable(t,cls._class)
-	return t;
+	local c = cls._class
+	local ctor = rawget(c,"_new") or module._constructor(c)
+	return ctor()
 end
 local _inst = module._inst
 
@@ -79,13 +114,16 @@ function module._checkLoad(name)
 end
 
 function module.__unm(op) 
-	return -( op._dbl or 0/0 ) -- 0/0 gives NaN in Lua
+	return 0/0 -- 0/0 gives NaN in Lua; Doubles have their own __unm
 end
 
 ---------- Object -------------------
 module.Object = {}
 
 function module.Object.class(self)
+	if type(self) == "cdata" then
+		return Double -- the metatable of a cdata is not accessible
+	end
 	local t = getmetatable(self) -- self is an instance
 	if t == Boolean._class then
 		if self then
@@ -222,15 +260,13 @@ module.Method["invokeOn:with:"] = module.Method.invokeOn_with_
 module.String = {}
 
 function module.String.concatenate_(self,argument)
-	self._str = self._str .. argument._str
-	return self
+	-- Strings are immutable because literals are shared
+	return _str(self._str .. argument._str)
 end
 module.String ["concatenate:"] = module.String.concatenate_
 
 function module.String.asSymbol(self)
-	local t = { _str = self._str }
-	setmetatable( t, Symbol._class )
-	return t
+	return _sym(self._str)
 end
 
 function module.String.hashcode(self)
@@ -293,7 +329,8 @@ function module.Array.length(self)
 end
 
 function module.Array.new_(self,length)
-	local t = { _n = length }
+	local t = tnew(length,1)
+	t._n = length
 	setmetatable( t, Array._class )
 	return t
 end